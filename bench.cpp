@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "model.h"
+#include "our_gl.h"
+#include "shader.h"
+
+// camera of all the runs, the one of the renderer
+constexpr vec3 eye = {1, 1, 3};
+constexpr vec3 center = {0, 0, 0};
+constexpr vec3 up = {0, 1, 0};
+
+// mesh rendered by the benchmark
+struct BenchScene {
+    std::string name;
+    std::string file;
+    double load_ms = 0;
+    std::unique_ptr<Model> model{};
+};
+
+// one configuration of a scene, the fastest of its repetitions is kept
+struct BenchRun {
+    std::string scene;
+    bool deferred;
+    int width, height, threads;
+    DrawStats stats{};
+    long long shaded = 0;  // fragments shaded
+    double shade_ms = 0;   // of the deferred shading pass, forward draws shade during rasterization
+    double encode_ms = 0;  // of writing the tga file
+    double total_ms = 0;
+};
+
+static void set_threads(const int n) {
+#ifdef _OPENMP
+    omp_set_num_threads(n);
+#else
+    (void)n;
+#endif
+}
+
+static int max_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// buffered obj writer for the synthetic meshes
+struct ObjWriter {
+    std::ofstream out;
+    std::string buf;
+    ObjWriter(const std::string &filename) : out(filename, std::ios::binary) {}
+    ~ObjWriter() { out.write(buf.data(), buf.size()); }
+    void line(const char *fmt, const double a, const double b, const double c) {
+        char s[96];
+        buf.append(s, std::snprintf(s, sizeof(s), fmt, a, b, c));
+    }
+    // texture coordinate and normal of the corners are the ones of the same index, or the given one for all three
+    void face(const int a, const int b, const int c, const int t=0) {
+        char s[96];
+        buf.append(s, std::snprintf(s, sizeof(s), "f %d/%d/%d %d/%d/%d %d/%d/%d\n", a, t ? t : a, t ? t : a, b, t ? t : b, t ? t : b, c, t ? t : c, t ? t : c));
+    }
+};
+
+// many tiny triangles: a unit sphere of slices x stacks quads, most of them smaller than a pixel
+static void write_sphere(const std::string &filename, const int slices, const int stacks) {
+    ObjWriter obj(filename);
+    for (int j = 0; j <= stacks; j++)
+        for (int i = 0; i <= slices; i++) {
+            const double theta = M_PI * j / stacks, phi = 2 * M_PI * i / slices;
+            const vec3 n = {std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)};
+            obj.line("v %.6f %.6f %.6f\n", n.x, n.y, n.z);
+            obj.line("vt %.6f %.6f %.6f\n", double(i) / slices, 1. - double(j) / stacks, 0);
+            obj.line("vn %.6f %.6f %.6f\n", n.x, n.y, n.z);
+        }
+    // counter-clockwise seen from outside
+    for (int j = 0; j < stacks; j++)
+        for (int i = 0; i < slices; i++) {
+            const int a = 1 + i + j * (slices + 1), b = a + 1, c = a + slices + 1, d = c + 1;
+            obj.face(a, b, d);
+            obj.face(a, d, c);
+        }
+}
+
+// a few huge triangles: a cube that covers most of the screen
+static void write_cube(const std::string &filename) {
+    ObjWriter obj(filename);
+    const int quads[6][4] = {{0, 1, 3, 2}, {4, 6, 7, 5}, {0, 4, 5, 1}, {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 5, 7, 3}};
+    for (int i = 0; i < 8; i++)
+        obj.line("v %.6f %.6f %.6f\n", i & 4 ? 1. : -1., i & 2 ? 1. : -1., i & 1 ? 1. : -1.);
+    obj.line("vt %.6f %.6f %.6f\n", 0, 0, 0);
+    obj.line("vn %.6f %.6f %.6f\n", 0, 0, 1);
+    for (const auto &q : quads)
+        for (const int k : {1, 2})
+            obj.face(q[0] + 1, q[k] + 1, q[k + 1] + 1, 1);
+}
+
+// high overdraw: screen-sized quads stacked back to front, every layer is closer than the previous ones and passes the depth test
+static void write_layers(const std::string &filename, const int layers) {
+    ObjWriter obj(filename);
+    for (int l = 0; l < layers; l++) {
+        const double z = -1 + 2. * l / (layers - 1);
+        for (const double y : {-1.5, 1.5})
+            for (const double x : {-1.5, 1.5})
+                obj.line("v %.6f %.6f %.6f\n", x, y, z);
+    }
+    obj.line("vt %.6f %.6f %.6f\n", 0, 0, 0);
+    obj.line("vn %.6f %.6f %.6f\n", 0, 0, 1);
+    for (int l = 0; l < layers; l++) {
+        const int a = 1 + l * 4;
+        obj.face(a, a + 1, a + 3, 1);
+        obj.face(a, a + 3, a + 2, 1);
+    }
+}
+
+// render a scene once with a fresh depth buffer and framebuffer, then write it to filename
+static BenchRun render(const BenchScene &scene, Shader &shader, const bool deferred, const int w, const int h, const int threads, const std::string &filename) {
+    BenchRun run = {scene.name, deferred, w, h, threads};
+    set_threads(threads);
+    lookat(eye, center, up);
+    projection(-1.f / (eye - center).norm());
+    viewport(w / 8, h / 8, w * 3 / 4, h * 3 / 4);
+    shader.uniforms();
+    DepthBuffer<DepthF64> zbuffer(w, h, -(eye - center).norm(), 0);
+    ColorBuffer framebuffer(w, h);
+    std::unique_ptr<GBuffer> gbuffer;
+    if (deferred)
+        gbuffer = std::make_unique<GBuffer>(w, h);
+
+    auto start = std::chrono::steady_clock::now();
+    const Model &model = *scene.model;
+    if (!deferred) {
+        run.stats = draw(model.nverts(), model.indices(), shader, framebuffer, zbuffer);
+        run.shaded = run.stats.fragments;
+    } else {
+        run.stats = draw(model.nverts(), model.indices(), shader, *gbuffer, zbuffer);
+        auto shading = std::chrono::steady_clock::now();
+        shade(*gbuffer, framebuffer);
+        run.shade_ms = elapsed_ms(shading);
+        run.shaded = gbuffer->shaded;
+    }
+    auto encoding = std::chrono::steady_clock::now();
+    if (!framebuffer.write_tga_file(filename))
+        std::cerr << "can't write " << filename << std::endl;
+    run.encode_ms = elapsed_ms(encoding);
+    run.total_ms = elapsed_ms(start);
+    return run;
+}
+
+// comma separated list of positive integers
+static std::vector<int> parse_list(const std::string &s) {
+    std::vector<int> ret;
+    for (size_t p = 0; p < s.size(); ) {
+        const size_t e = std::min(s.find(',', p), s.size());
+        const int n = std::atoi(s.substr(p, e - p).c_str());
+        if (n > 0)
+            ret.push_back(n);
+        p = e + 1;
+    }
+    return ret;
+}
+
+// JSON string literal, the scene names come from file names and can hold any character
+static std::string json_string(const std::string &s) {
+    std::string ret = "\"";
+    for (const char c : s) {
+        if (c == '"' || c == '\\')
+            ret += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            char code[7];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            ret += code;
+        } else
+            ret += c;
+    }
+    return ret + "\"";
+}
+
+static void write_json(std::ostream &out, const std::vector<BenchScene> &scenes, const std::vector<BenchRun> &runs, const int repeat) {
+    out << "{\n  \"benchmark\": \"gakubench\",\n  \"max_threads\": " << max_threads() << ",\n  \"repeat\": " << repeat << ",\n  \"scenes\": [\n";
+    for (size_t i = 0; i < scenes.size(); i++)
+        out << "    {\"name\": " << json_string(scenes[i].name) << ", \"vertices\": " << scenes[i].model->nverts() << ", \"faces\": " << scenes[i].model->nfaces()
+            << ", \"load_ms\": " << scenes[i].load_ms << "}" << (i + 1 < scenes.size() ? "," : "") << "\n";
+    out << "  ],\n  \"runs\": [\n";
+    // one run per line, so that two result files diff run by run
+    for (size_t i = 0; i < runs.size(); i++) {
+        const BenchRun &r = runs[i];
+        const DrawStats &s = r.stats;
+        // throughputs over the stages that do the work: triangles through the whole draw, fragments through rasterization and shading
+        const double draw_ms = s.vertex_ms + s.setup_ms + s.raster_ms + r.shade_ms;
+        out << "    {\"scene\": " << json_string(r.scene) << ", \"mode\": \"" << (r.deferred ? "deferred" : "forward") << "\", \"width\": " << r.width
+            << ", \"height\": " << r.height << ", \"threads\": " << r.threads << ", \"faces\": " << s.faces << ", \"triangles\": " << s.triangles
+            << ", \"fragments\": " << s.fragments << ", \"shaded\": " << r.shaded << ", \"vertex_ms\": " << s.vertex_ms << ", \"setup_ms\": " << s.setup_ms
+            << ", \"raster_ms\": " << s.raster_ms << ", \"shade_ms\": " << r.shade_ms << ", \"encode_ms\": " << r.encode_ms << ", \"total_ms\": " << r.total_ms
+            << ", \"triangles_per_s\": " << (draw_ms > 0 ? s.triangles / draw_ms * 1e3 : 0)
+            << ", \"fragments_per_s\": " << (s.raster_ms + r.shade_ms > 0 ? r.shaded / (s.raster_ms + r.shade_ms) * 1e3 : 0) << "}"
+            << (i + 1 < runs.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> resolutions = {1000, 2000};
+    std::vector<int> threads = {1};
+    if (max_threads() > 1)
+        threads.push_back(max_threads());
+    int repeat = 3;
+    std::string json = "gakubench.json";
+    std::vector<std::string> models;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (!arg.compare(0, 6, "--res="))
+            resolutions = parse_list(arg.substr(6));
+        else if (!arg.compare(0, 10, "--threads="))
+            threads = parse_list(arg.substr(10));
+        else if (!arg.compare(0, 9, "--repeat="))
+            repeat = std::max(1, std::atoi(arg.c_str() + 9));
+        else if (!arg.compare(0, 7, "--json="))
+            json = arg.substr(7);
+        else if (!arg.compare(0, 2, "--")) {
+            std::cerr << "Usage: gakubench [model.obj...] [options], the bundled diablo3_pose model by default" << std::endl;
+            std::cerr << "Options: --res=1000,2000         square image sizes" << std::endl;
+            std::cerr << "         --threads=1,n           thread counts, 1 and all the cores by default" << std::endl;
+            std::cerr << "         --repeat=3              repetitions of each run, the fastest one is reported" << std::endl;
+            std::cerr << "         --json=gakubench.json   result file" << std::endl;
+            return 1;
+        } else
+            models.push_back(arg);
+    }
+    if (models.empty())
+        models.push_back(GAKU_SOURCE_DIR "/obj/diablo3_pose/diablo3_pose.obj");
+    if (resolutions.empty() || threads.empty()) {
+        std::cerr << "nothing to run" << std::endl;
+        return 1;
+    }
+    // timings of kernels that disagree with the reference are worthless
+    if (!check_block_kernels())
+        return 1;
+
+    // the synthetic meshes and the frames go to a scratch directory
+    const std::filesystem::path tmp = std::filesystem::temp_directory_path() / ("gakubench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(tmp);
+    std::vector<BenchScene> scenes;
+    for (const std::string &m : models)
+        scenes.push_back({std::filesystem::path(m).stem().string(), m});
+    scenes.push_back({"tiny_triangles", (tmp / "sphere.obj").string()});
+    write_sphere(scenes.back().file, 512, 256);
+    scenes.push_back({"huge_triangles", (tmp / "cube.obj").string()});
+    write_cube(scenes.back().file);
+    scenes.push_back({"overdraw", (tmp / "layers.obj").string()});
+    write_layers(scenes.back().file, 32);
+
+    set_threads(max_threads());
+    for (BenchScene &scene : scenes) {
+        auto start = std::chrono::steady_clock::now();
+        // every model is parsed, none comes from a binary cache, so that load_ms compares between runs
+        scene.model = std::make_unique<Model>(scene.file, Model::MAPPED);
+        scene.load_ms = elapsed_ms(start);
+    }
+
+    std::vector<BenchRun> runs;
+    const std::string frame = (tmp / "frame.tga").string();
+    for (BenchScene &scene : scenes) {
+        lookat(eye, center, up);
+        projection(-1.f / (eye - center).norm());
+        Shader shader(*scene.model, Texture::TRILINEAR);
+        for (const int res : resolutions)
+            for (const int n : threads)
+                for (const bool deferred : {false, true}) {
+                    BenchRun best;
+                    for (int k = 0; k < repeat; k++) {
+                        const BenchRun r = render(scene, shader, deferred, res, res, n, frame);
+                        if (!k || r.total_ms < best.total_ms)
+                            best = r;
+                    }
+                    const DrawStats &s = best.stats;
+                    std::fprintf(stderr, "%-16s %-8s %5dx%-5d %3d threads  vertex %8.2f  setup %8.2f  raster %8.2f  shade %8.2f  encode %8.2f  total %8.2f ms\n",
+                                 scene.name.c_str(), deferred ? "deferred" : "forward", res, res, n, s.vertex_ms, s.setup_ms, s.raster_ms, best.shade_ms,
+                                 best.encode_ms, best.total_ms);
+                    runs.push_back(best);
+                }
+    }
+    std::filesystem::remove_all(tmp);
+
+    std::ofstream out(json);
+    write_json(out, scenes, runs, repeat);
+    std::cerr << "results " << (out.good() ? "written to " : "could not be written to ") << json << std::endl;
+    return out.good() ? 0 : 1;
+}
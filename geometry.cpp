@@ -1,6 +1,8 @@
 #include "geometry.h"
 
-vec3 cross(const vec3 &v1, const vec3 &v2) {
-    return vec<3>{v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x};
+template<typename T> vec<3,T> cross(const vec<3,T> &v1, const vec<3,T> &v2) {
+    return vec<3,T>{v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x};
 }
 
+template vec<3,double> cross(const vec<3,double> &, const vec<3,double> &);
+template vec<3,float> cross(const vec<3,float> &, const vec<3,float> &);
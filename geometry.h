@@ -1,212 +1,303 @@
 #pragma once
 #include <cmath>
 #include <cassert>
+#include <cstddef>
 #include <iostream>
+#include <type_traits>
 
-template<int n> struct vec {
-    double data[n] = {0};
-    double& operator[](const int i)       { assert(i>=0 && i<n); return data[i]; }
-    double  operator[](const int i) const { assert(i>=0 && i<n); return data[i]; }
-    double norm2() const { return *this * *this; }
-    double norm()  const { return std::sqrt(norm2()); }
+// vectors whose size is a power of two up to 32 bytes are aligned to their size, so that they load as one register
+constexpr std::size_t vec_align(const int n, const std::size_t size) { return !(n & (n-1)) && n*size<=32 ? n*size : size; }
+
+template<int n, typename T=double> struct vec {
+    alignas(vec_align(n, sizeof(T))) T data[n] = {0};
+    T& operator[](const int i)       { assert(i>=0 && i<n); return data[i]; }
+    T  operator[](const int i) const { assert(i>=0 && i<n); return data[i]; }
+    T norm2() const { return *this * *this; }
+    T norm()  const { return std::sqrt(norm2()); }
 };
 
-template<int n> double operator*(const vec<n>& lhs, const vec<n>& rhs) {
-    double ret = 0;
+// scalars of the arithmetic operators are not deduced, so that vec<n,float> * 2. works
+template<typename T> using scalar = std::type_identity_t<T>;
+
+template<int n, typename T> T operator*(const vec<n,T>& lhs, const vec<n,T>& rhs) {
+    T ret = 0;
     for (int i=n; i--; ret+=lhs[i]*rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> vec<n,T> operator+(const vec<n,T>& lhs, const vec<n,T>& rhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]+=rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> vec<n,T> operator-(const vec<n,T>& lhs, const vec<n,T>& rhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]-=rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator*(const double& rhs, const vec<n> &lhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> vec<n,T> operator*(const scalar<T>& rhs, const vec<n,T> &lhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]*=rhs);
     return ret;
 }
 
-template<int n> vec<n> operator*(const vec<n>& lhs, const double& rhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> vec<n,T> operator*(const vec<n,T>& lhs, const scalar<T>& rhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]*=rhs);
     return ret;
 }
 
-template<int n> vec<n> operator/(const vec<n>& lhs, const double& rhs) {
-    vec<n> ret = lhs;
+template<int n, typename T> vec<n,T> operator/(const vec<n,T>& lhs, const scalar<T>& rhs) {
+    vec<n,T> ret = lhs;
     for (int i=n; i--; ret[i]/=rhs);
     return ret;
 }
 
-template<int n1,int n2> vec<n1> embed(const vec<n2> &v, double fill=1) {
-    vec<n1> ret;
+template<int n1, int n2, typename T> vec<n1,T> embed(const vec<n2,T> &v, scalar<T> fill=1) {
+    vec<n1,T> ret;
     for (int i=n1; i--; ret[i]=(i<n2?v[i]:fill));
     return ret;
 }
 
-template<int n1,int n2> vec<n1> proj(const vec<n2> &v) {
-    vec<n1> ret;
+template<int n1, int n2, typename T> vec<n1,T> proj(const vec<n2,T> &v) {
+    vec<n1,T> ret;
     for (int i=n1; i--; ret[i]=v[i]);
     return ret;
 }
 
-template<int n> std::ostream& operator<<(std::ostream& out, const vec<n>& v) {
+// conversion to another scalar type
+template<typename U, int n, typename T> vec<n,U> cast(const vec<n,T> &v) {
+    vec<n,U> ret;
+    for (int i=n; i--; ret[i]=static_cast<U>(v[i]));
+    return ret;
+}
+
+template<int n, typename T> std::ostream& operator<<(std::ostream& out, const vec<n,T>& v) {
     for (int i=0; i<n; i++) out << v[i] << " ";
     return out;
 }
 
-template<> struct vec<2> {
-    double x = 0, y = 0;
-    double& operator[](const int i)       { assert(i>=0 && i<2); return i ? y : x; }
-    double  operator[](const int i) const { assert(i>=0 && i<2); return i ? y : x; }
-    double norm2() const { return *this * *this; }
-    double norm()  const { return std::sqrt(norm2()); }
-    vec<2> normalized() { return (*this)/norm(); }
+// the named components are indexed through a table of member pointers instead of a chain of branches
+template<typename T> struct alignas(vec_align(2, sizeof(T))) vec<2,T> {
+    T x = 0, y = 0;
+    static constexpr T vec::*member[2] = {&vec::x, &vec::y};
+    T& operator[](const int i)       { assert(i>=0 && i<2); return this->*member[i]; }
+    T  operator[](const int i) const { assert(i>=0 && i<2); return this->*member[i]; }
+    T norm2() const { return *this * *this; }
+    T norm()  const { return std::sqrt(norm2()); }
+    vec<2,T> normalized() const { return (*this)/norm(); }
 };
 
-template<> struct vec<3> {
-    double x = 0, y = 0, z = 0;
-    double& operator[](const int i)       { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
-    double  operator[](const int i) const { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
-    double norm2() const { return *this * *this; }
-    double norm()  const { return std::sqrt(norm2()); }
-    vec<3> normalized() { return (*this)/norm(); }
+template<typename T> struct vec<3,T> {
+    T x = 0, y = 0, z = 0;
+    static constexpr T vec::*member[3] = {&vec::x, &vec::y, &vec::z};
+    T& operator[](const int i)       { assert(i>=0 && i<3); return this->*member[i]; }
+    T  operator[](const int i) const { assert(i>=0 && i<3); return this->*member[i]; }
+    T norm2() const { return *this * *this; }
+    T norm()  const { return std::sqrt(norm2()); }
+    vec<3,T> normalized() const { return (*this)/norm(); }
 };
 
 typedef vec<2> vec2;
 typedef vec<3> vec3;
 typedef vec<4> vec4;
-vec3 cross(const vec3 &v1, const vec3 &v2);
+typedef vec<2,float> vec2f;
+typedef vec<3,float> vec3f;
+typedef vec<4,float> vec4f;
+template<typename T> vec<3,T> cross(const vec<3,T> &v1, const vec<3,T> &v2);
 
-template<int n> struct dt;
+template<int n, typename T> struct dt;
+template<int n, typename T> struct adj;
 
-template<int nrows,int ncols> struct mat {
-    vec<ncols> rows[nrows] = {{}};
+template<int nrows, int ncols, typename T=double> struct mat {
+    vec<ncols,T> rows[nrows] = {{}};
 
-          vec<ncols>& operator[] (const int idx)       { assert(idx>=0 && idx<nrows); return rows[idx]; }
-    const vec<ncols>& operator[] (const int idx) const { assert(idx>=0 && idx<nrows); return rows[idx]; }
+          vec<ncols,T>& operator[] (const int idx)       { assert(idx>=0 && idx<nrows); return rows[idx]; }
+    const vec<ncols,T>& operator[] (const int idx) const { assert(idx>=0 && idx<nrows); return rows[idx]; }
 
-    vec<nrows> col(const int idx) const {
+    vec<nrows,T> col(const int idx) const {
         assert(idx>=0 && idx<ncols);
-        vec<nrows> ret;
+        vec<nrows,T> ret;
         for (int i=nrows; i--; ret[i]=rows[i][idx]);
         return ret;
     }
 
-    void set_col(const int idx, const vec<nrows> &v) {
+    void set_col(const int idx, const vec<nrows,T> &v) {
         assert(idx>=0 && idx<ncols);
         for (int i=nrows; i--; rows[i][idx]=v[i]);
     }
 
-    static mat<nrows,ncols> identity() {
-        mat<nrows,ncols> ret;
+    static mat<nrows,ncols,T> identity() {
+        mat<nrows,ncols,T> ret;
         for (int i=nrows; i--; )
             for (int j=ncols;j--; ret[i][j]=(i==j));
         return ret;
     }
 
-    double det() const {
-        return dt<ncols>::det(*this);
+    T det() const {
+        return dt<ncols,T>::det(*this);
     }
 
-    mat<nrows-1,ncols-1> get_minor(const int row, const int col) const {
-        mat<nrows-1,ncols-1> ret;
+    mat<nrows-1,ncols-1,T> get_minor(const int row, const int col) const {
+        mat<nrows-1,ncols-1,T> ret;
         for (int i=nrows-1; i--; )
             for (int j=ncols-1;j--; ret[i][j]=rows[i<row?i:i+1][j<col?j:j+1]);
         return ret;
     }
 
-    double cofactor(const int row, const int col) const {
+    T cofactor(const int row, const int col) const {
         return get_minor(row,col).det()*((row+col)%2 ? -1 : 1);
     }
 
-    mat<nrows,ncols> adjugate() const {
-        mat<nrows,ncols> ret;
-        for (int i=nrows; i--; )
-            for (int j=ncols; j--; ret[i][j]=cofactor(i,j));
-        return ret;
+    mat<nrows,ncols,T> adjugate() const {
+        return adj<ncols,T>::cofactors(*this);
     }
 
-    mat<nrows,ncols> invert_transpose() const {
-        mat<nrows,ncols> ret = adjugate();
+    mat<nrows,ncols,T> invert_transpose() const {
+        mat<nrows,ncols,T> ret = adjugate();
         return ret/(ret[0]*rows[0]);
     }
 
-    mat<nrows,ncols> invert() const {
+    mat<nrows,ncols,T> invert() const {
         return invert_transpose().transpose();
     }
 
-    mat<ncols,nrows> transpose() const {
-        mat<ncols,nrows> ret;
+    mat<ncols,nrows,T> transpose() const {
+        mat<ncols,nrows,T> ret;
         for (int i=ncols; i--; ret[i]=this->col(i));
         return ret;
     }
 };
 
-template<int nrows,int ncols> vec<nrows> operator*(const mat<nrows,ncols>& lhs, const vec<ncols>& rhs) {
-    vec<nrows> ret;
+template<int nrows, int ncols, typename T> vec<nrows,T> operator*(const mat<nrows,ncols,T>& lhs, const vec<ncols,T>& rhs) {
+    vec<nrows,T> ret;
     for (int i=nrows; i--; ret[i]=lhs[i]*rhs);
     return ret;
 }
 
-template<int R1,int C1,int C2>mat<R1,C2> operator*(const mat<R1,C1>& lhs, const mat<C1,C2>& rhs) {
-    mat<R1,C2> result;
+template<int R1, int C1, int C2, typename T> mat<R1,C2,T> operator*(const mat<R1,C1,T>& lhs, const mat<C1,C2,T>& rhs) {
+    mat<R1,C2,T> result;
     for (int i=R1; i--; )
         for (int j=C2; j--; result[i][j]=lhs[i]*rhs.col(j));
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator*(const mat<nrows,ncols>& lhs, const double& val) {
-    mat<nrows,ncols> result;
+template<int nrows, int ncols, typename T> mat<nrows,ncols,T> operator*(const mat<nrows,ncols,T>& lhs, const scalar<T>& val) {
+    mat<nrows,ncols,T> result;
     for (int i=nrows; i--; result[i] = lhs[i]*val);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator/(const mat<nrows,ncols>& lhs, const double& val) {
-    mat<nrows,ncols> result;
+template<int nrows, int ncols, typename T> mat<nrows,ncols,T> operator/(const mat<nrows,ncols,T>& lhs, const scalar<T>& val) {
+    mat<nrows,ncols,T> result;
     for (int i=nrows; i--; result[i] = lhs[i]/val);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator+(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
-    mat<nrows,ncols> result;
+template<int nrows, int ncols, typename T> mat<nrows,ncols,T> operator+(const mat<nrows,ncols,T>& lhs, const mat<nrows,ncols,T>& rhs) {
+    mat<nrows,ncols,T> result;
     for (int i=nrows; i--; )
         for (int j=ncols; j--; result[i][j]=lhs[i][j]+rhs[i][j]);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator-(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
-    mat<nrows,ncols> result;
+template<int nrows, int ncols, typename T> mat<nrows,ncols,T> operator-(const mat<nrows,ncols,T>& lhs, const mat<nrows,ncols,T>& rhs) {
+    mat<nrows,ncols,T> result;
     for (int i=nrows; i--; )
         for (int j=ncols; j--; result[i][j]=lhs[i][j]-rhs[i][j]);
     return result;
 }
 
-template<int nrows,int ncols> std::ostream& operator<<(std::ostream& out, const mat<nrows,ncols>& m) {
+// conversion to another scalar type
+template<typename U, int nrows, int ncols, typename T> mat<nrows,ncols,U> cast(const mat<nrows,ncols,T> &m) {
+    mat<nrows,ncols,U> ret;
+    for (int i=nrows; i--; ret[i]=cast<U>(m[i]));
+    return ret;
+}
+
+template<int nrows, int ncols, typename T> std::ostream& operator<<(std::ostream& out, const mat<nrows,ncols,T>& m) {
     for (int i=0; i<nrows; i++) out << m[i] << std::endl;
     return out;
 }
 
-template<int n> struct dt {
-    static double det(const mat<n,n>& src) {
-        double ret = 0;
+// determinant by cofactor expansion along the first row, closed forms up to 4x4
+template<int n, typename T> struct dt {
+    static T det(const mat<n,n,T>& src) {
+        T ret = 0;
         for (int i=n; i--; ret += src[0][i]*src.cofactor(0,i));
         return ret;
     }
 };
 
-template<> struct dt<1> {
-    static double det(const mat<1,1>& src) {
+template<typename T> struct dt<1,T> {
+    static T det(const mat<1,1,T>& src) {
         return src[0][0];
     }
 };
 
+template<typename T> struct dt<2,T> {
+    static T det(const mat<2,2,T>& m) {
+        return m[0][0]*m[1][1] - m[0][1]*m[1][0];
+    }
+};
+
+template<typename T> struct dt<3,T> {
+    static T det(const mat<3,3,T>& m) {
+        return m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+             + m[0][1]*(m[1][2]*m[2][0] - m[1][0]*m[2][2])
+             + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    }
+};
+
+template<typename T> struct dt<4,T> {
+    static T det(const mat<4,4,T>& m) {
+        // 2x2 determinants of the two upper rows (s) and of the two lower rows (c)
+        T s0 = m[0][0]*m[1][1] - m[1][0]*m[0][1], s1 = m[0][0]*m[1][2] - m[1][0]*m[0][2], s2 = m[0][0]*m[1][3] - m[1][0]*m[0][3];
+        T s3 = m[0][1]*m[1][2] - m[1][1]*m[0][2], s4 = m[0][1]*m[1][3] - m[1][1]*m[0][3], s5 = m[0][2]*m[1][3] - m[1][2]*m[0][3];
+        T c5 = m[2][2]*m[3][3] - m[3][2]*m[2][3], c4 = m[2][1]*m[3][3] - m[3][1]*m[2][3], c3 = m[2][1]*m[3][2] - m[3][1]*m[2][2];
+        T c2 = m[2][0]*m[3][3] - m[3][0]*m[2][3], c1 = m[2][0]*m[3][2] - m[3][0]*m[2][2], c0 = m[2][0]*m[3][1] - m[3][0]*m[2][1];
+        return s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+    }
+};
+
+// matrix of cofactors (the transpose of the adjugate), closed forms up to 4x4
+template<int n, typename T> struct adj {
+    static mat<n,n,T> cofactors(const mat<n,n,T>& src) {
+        mat<n,n,T> ret;
+        for (int i=n; i--; )
+            for (int j=n; j--; ret[i][j]=src.cofactor(i,j));
+        return ret;
+    }
+};
+
+template<typename T> struct adj<2,T> {
+    static mat<2,2,T> cofactors(const mat<2,2,T>& m) {
+        return {{{m[1][1], -m[1][0]}, {-m[0][1], m[0][0]}}};
+    }
+};
+
+template<typename T> struct adj<3,T> {
+    static mat<3,3,T> cofactors(const mat<3,3,T>& m) {
+        // with cyclic indices the sign of the cofactor comes for free
+        mat<3,3,T> ret;
+        for (int i=3; i--; )
+            for (int j=3; j--; ret[i][j]=m[(i+1)%3][(j+1)%3]*m[(i+2)%3][(j+2)%3] - m[(i+1)%3][(j+2)%3]*m[(i+2)%3][(j+1)%3]);
+        return ret;
+    }
+};
+
+template<typename T> struct adj<4,T> {
+    static mat<4,4,T> cofactors(const mat<4,4,T>& m) {
+        // 2x2 determinants of the two upper rows (s) and of the two lower rows (c)
+        T s0 = m[0][0]*m[1][1] - m[1][0]*m[0][1], s1 = m[0][0]*m[1][2] - m[1][0]*m[0][2], s2 = m[0][0]*m[1][3] - m[1][0]*m[0][3];
+        T s3 = m[0][1]*m[1][2] - m[1][1]*m[0][2], s4 = m[0][1]*m[1][3] - m[1][1]*m[0][3], s5 = m[0][2]*m[1][3] - m[1][2]*m[0][3];
+        T c5 = m[2][2]*m[3][3] - m[3][2]*m[2][3], c4 = m[2][1]*m[3][3] - m[3][1]*m[2][3], c3 = m[2][1]*m[3][2] - m[3][1]*m[2][2];
+        T c2 = m[2][0]*m[3][3] - m[3][0]*m[2][3], c1 = m[2][0]*m[3][2] - m[3][0]*m[2][2], c0 = m[2][0]*m[3][1] - m[3][0]*m[2][1];
+        return {{{ m[1][1]*c5 - m[1][2]*c4 + m[1][3]*c3, -m[1][0]*c5 + m[1][2]*c2 - m[1][3]*c1,  m[1][0]*c4 - m[1][1]*c2 + m[1][3]*c0, -m[1][0]*c3 + m[1][1]*c1 - m[1][2]*c0},
+                 {-m[0][1]*c5 + m[0][2]*c4 - m[0][3]*c3,  m[0][0]*c5 - m[0][2]*c2 + m[0][3]*c1, -m[0][0]*c4 + m[0][1]*c2 - m[0][3]*c0,  m[0][0]*c3 - m[0][1]*c1 + m[0][2]*c0},
+                 { m[3][1]*s5 - m[3][2]*s4 + m[3][3]*s3, -m[3][0]*s5 + m[3][2]*s2 - m[3][3]*s1,  m[3][0]*s4 - m[3][1]*s2 + m[3][3]*s0, -m[3][0]*s3 + m[3][1]*s1 - m[3][2]*s0},
+                 {-m[2][1]*s5 + m[2][2]*s4 - m[2][3]*s3,  m[2][0]*s5 - m[2][2]*s2 + m[2][3]*s1, -m[2][0]*s4 + m[2][1]*s2 - m[2][3]*s0,  m[2][0]*s3 - m[2][1]*s1 + m[2][2]*s0}}};
+    }
+};
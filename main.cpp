@@ -1,13 +1,18 @@
-#include <limits>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <string>
 #include "model.h"
 #include "our_gl.h"
-
-// image size
-constexpr int width = 5000;
-constexpr int height = 5000;
-
-// light direction
-constexpr vec3 light_dir = {1, 1, 1};
+#include "profile.h"
+#include "scene.h"
+#include "server.h"
+#include "shader.h"
+#include "task.h"
 
 // camera position
 constexpr vec3 eye = {1, 1, 3};
@@ -16,90 +21,398 @@ constexpr vec3 center = {0, 0, 0};
 // up direction (may not be perpendicular to the camera lookat direction)
 constexpr vec3 up = {0, 1, 0};
 
-// mvp matrices
-extern mat<4, 4> ModelView;
-extern mat<4, 4> Projection;
-
-struct Shader: IShader {
-    const Model &model;
-    // light direction in camera space
-    vec3 uniform_l;
-    // texture coordinates
-    mat<2, 3> varying_uv;
-    // normal vector
-    mat<3, 3> varying_nrm;
-    // triangle in camera space
-    mat<3, 3> view_tri;
-
-    Shader(const Model &m): model(m) {
-        // transform light direction to camera space
-        uniform_l = proj<3>(ModelView * embed<4>(light_dir, 0.)).normalized();
+// camera of a frame
+struct Camera {
+    vec3 eye, center;
+};
+
+// options of the command line
+struct Options {
+    bool deferred = false;
+    Model::Loader loader = Model::CACHED;
+    Texture::Filter filter = Texture::TRILINEAR;
+    std::string depth_format = "f64";
+    Camera camera = {eye, center};       // of a single frame, the turntable starts from it and the poses look at its center by default
+    int turntable = 0;                   // number of frames around the model, 0 for a single frame
+    std::string poses;                   // file of camera poses
+    std::string trace;                   // Chrome trace output of a profiling build
+    std::string scene;                   // scene file, instances of models
+    int shadow_map = 2048;               // size of the shadow map, 0 for no shadows
+    bool normal_map = true;              // tangent space normal mapping of the models that have a normal map
+    int width = 5000, height = 5000;     // image size
+    int strip = 0;                       // rows rendered at once, 0 for the whole image
+    int msaa = 1;                        // samples per pixel, 1, 4 or 8
+    std::string output = "framebuffer.tga"; // image file, frames numbered before the extension
+    bool serve = false;                  // render jobs from a socket or stdin
+    std::string socket;                  // unix socket of the server, stdin if empty
+    int jobs = 2;                        // jobs rendered at once by the server
+    int cache_mb = 1024;                 // size of the models kept by the server
+};
+
+// file of frame i: the output name, with the frame number before the extension when there are several frames
+std::string frame_filename(const std::string &output, const int i, const int frames) {
+    if (frames < 2)
+        return output;
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04d", i);
+    const size_t slash = output.rfind('/'), dot = output.rfind('.');
+    const size_t at = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? dot : output.size();
+    return output.substr(0, at) + number + output.substr(at);
+}
+
+// cameras of the frames: the camera of the options, n frames turning it around the vertical axis through its center,
+// or one per line "ex ey ez [cx cy cz]" of the poses file
+bool cameras(const Options &options, std::vector<Camera> &frames) {
+    if (!options.poses.empty()) {
+        std::ifstream in(options.poses);
+        if (in.fail()) {
+            std::cerr << "can't open file " << options.poses << std::endl;
+            return false;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream iss(line);
+            Camera c = {{}, options.camera.center};
+            if (!(iss >> c.eye.x >> c.eye.y >> c.eye.z))
+                continue;
+            iss >> c.center.x >> c.center.y >> c.center.z;
+            frames.push_back(c);
+        }
+    } else if (options.turntable > 0) {
+        for (int i = 0; i < options.turntable; i++) {
+            const double a = 2 * M_PI * i / options.turntable;
+            const vec3 c = options.camera.center, d = options.camera.eye - c;
+            frames.push_back({c + vec3{d.x * std::cos(a) - d.z * std::sin(a), d.y, d.x * std::sin(a) + d.z * std::cos(a)}, c});
+        }
+    } else
+        frames.push_back(options.camera);
+    return !frames.empty();
+}
+
+// render the scene for every camera with a depth buffer of the given format; the shaders and buffers are set up once, strips of the
+// frames are rendered in one of two framebuffers while the previous strip is written from the other one
+template<class Format> bool render(const Scene &scene, const Options &options, const std::vector<Camera> &frames) {
+    // one shader per instance, per frame only their uniforms change
+    std::vector<std::unique_ptr<Shader>> shaders;
+    for (const Instance &inst : scene.instances) {
+        shaders.push_back(std::make_unique<Shader>(*scene.meshes[inst.mesh].model, options.filter, inst.transform));
+        shaders.back()->normal_map(options.normal_map);
     }
 
-    // vertex shader
-    virtual void vertex(const int iface, const int nthvert, vec4 &gl_Position) {
-        varying_uv.set_col(nthvert, model.uv(iface, nthvert));
-        // transform normal vector to camera space, note that the matrix is the inverse transpose of that of the vertex
-        varying_nrm.set_col(nthvert,  proj<3>(ModelView.invert_transpose() * embed<4>(model.normal(iface, nthvert), 0.f)));
-        gl_Position = ModelView * embed<4>(model.vert(iface, nthvert));
-        // transform triangle to camera space (before projection)
-        view_tri.set_col(nthvert, proj<3>(gl_Position) / gl_Position[3]);
-        gl_Position = Projection * gl_Position;
+    // shadow map, rendered once since the light does not move with the camera: an orthographic view along the light direction framing
+    // the bounding sphere of the scene, depth only with the positions of the vertices
+    std::unique_ptr<ShadowMap> shadowmap;
+    if (options.shadow_map > 0) {
+        auto start = std::chrono::steady_clock::now();
+        ProfileScope scope("shadow");
+        const int size = options.shadow_map;
+        shadowmap = std::make_unique<ShadowMap>(size, size);
+        const Box bounds = scene.bounds();
+        const double radius = std::max(1e-3, (bounds.max - bounds.min).norm() / 2);
+        // the view is scaled by 1 / radius so that the sphere spans [-1, 1] and the whole map, whatever the size of the scene
+        lookat(bounds.center() + light_dir, bounds.center(), up);
+        ModelView = mat<4, 4>{{{1 / radius, 0, 0, 0}, {0, 1 / radius, 0, 0}, {0, 0, 1 / radius, 0}, {0, 0, 0, 1}}} * ModelView;
+        projection(0);
+        viewport(0, 0, size, size);
+        DrawStats stats;
+        for (const Instance &inst : scene.instances) {
+            const Model &model = *scene.meshes[inst.mesh].model;
+            DepthShader shader(model, inst.transform);
+            stats += draw(model.nverts(), model.indices(), shader, *shadowmap);
+        }
+        for (auto &shader : shaders)
+            shader->shadow(shadowmap.get());
+        std::cerr << "shadow pass: " << stats.triangles << " triangles, " << stats.fragments << " depth values written in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
     }
 
-    // fragment shader
-    virtual bool fragment(const vec3 bc, TGAColor &gl_FragColor) {
-        // interpolate normal vector and texture coordinates
-        vec3 n = (varying_nrm * bc).normalized();
-        vec2 uv = varying_uv * bc;
-
-        // diffuse lighting
-        double diff = std::max(0., n * uniform_l);
-        // reflection light
-        vec3 r = (n * (n * uniform_l) * 2 - uniform_l).normalized();;
-        // specular lighting, because the camera is looking at -z direction, so the intensity is proportional to r.z
-        double spec = std::pow(std::max(r.z, 0.), 5 + sample2D(model.specular(), uv)[0]);
-        // color from texture
-        TGAColor color = sample2D(model.diffuse(), uv);
-        // Blinn-Phong reflection model
-        for (int i = 0; i < 3; i++) {
-            gl_FragColor[i] = std::min<int>(10 + color[i] * (diff + spec), 255);
+    // with perspective the screen depth of everything in front of the camera is in (-f, 0), the depth range covers the farthest camera
+    double far = 0;
+    for (const Camera &c : frames)
+        far = std::max(far, (c.eye - c.center).norm());
+    // the image is rendered in strips of whole tiles, each one with buffers of the size of a strip and its own binning and culling,
+    // so that the memory does not grow with the height of the image
+    const int width = options.width, height = options.height;
+    const int strip = options.strip > 0 ? std::min(height, (options.strip + tile_size - 1) / tile_size * tile_size) : height;
+    DepthBuffer<Format> zbuffer(width, strip, -far, 0, options.msaa);
+    ColorBuffer framebuffers[2] = {ColorBuffer(width, strip), ColorBuffer(width, strip)};
+    // multisampled, the samples are drawn into their own buffer and resolved into the framebuffer
+    std::unique_ptr<ColorBuffer> multisampled;
+    if (options.msaa > 1)
+        multisampled = std::make_unique<ColorBuffer>(width, strip, options.msaa);
+    std::unique_ptr<GBuffer> gbuffer;
+    if (options.deferred)
+        gbuffer = std::make_unique<GBuffer>(width, strip);
+    if (strip < height)
+        std::cerr << "rendering in " << (height + strip - 1) / strip << " strips of " << strip << " rows" << std::endl;
+
+    // a strip is written while the next one renders in the other framebuffer, the file of a frame stays open until its last strip is out
+    bool ok = true;
+    std::future<bool> written;
+    std::unique_ptr<TGAWriter> files[2];
+    int strips = 0;
+    for (int i = 0; i < static_cast<int>(frames.size()); i++) {
+        auto start = std::chrono::steady_clock::now();
+        ProfileScope scope("frame");
+        const std::string filename = frame_filename(options.output, i, frames.size());
+        TGAWriter &file = *(files[i % 2] = std::make_unique<TGAWriter>(filename, width, height, TGAImage::RGB));
+        ok = file.good() && ok;
+        lookat(frames[i].eye, frames[i].center, up);
+        projection(-1.f / (frames[i].eye - frames[i].center).norm());
+        for (auto &shader : shaders)
+            shader->uniforms();
+
+        SceneStats culling;
+        culling.instances = scene.instances.size();
+        DrawStats stats;
+        long long fragments = 0, shaded = 0;
+        for (int y = 0; y < height; y += strip) {
+            ColorBuffer &framebuffer = framebuffers[strips++ % 2];
+            ColorBuffer &target = multisampled ? *multisampled : framebuffer;
+            target.clear();
+            zbuffer.clear();
+            // the viewport moved down by the rows of the strips above, the rows of the strip are then the ones of the buffer
+            viewport(width / 8, height / 8 - y, width * 3 / 4, height * 3 / 4);
+
+            // instances in the frustum of the strip nearest first, then per instance the meshlets in the frustum and not behind what
+            // is already drawn; forward: vertex shader, culling, clipping, tile binning and rasterization of their faces, deferred:
+            // the same with the depth test only, then shading of the visible fragments
+            const mat<4, 4> VP = Viewport * Projection * ModelView;
+            std::vector<int> visible, faces;
+            scene.cull(VP, width, strip, visible, culling);
+            if (options.deferred)
+                gbuffer->clear();
+            for (const int inst : visible) {
+                scene.faces(inst, VP, zbuffer, faces, culling);
+                const Model &model = *scene.meshes[scene.instances[inst].mesh].model;
+                if (faces.empty())
+                    continue;
+                const std::vector<int> *list = static_cast<int>(faces.size()) < model.nfaces() ? &faces : nullptr;
+                if (!options.deferred)
+                    stats += draw(model.nverts(), model.indices(), *shaders[inst], target, zbuffer, list);
+                else
+                    stats += draw(model.nverts(), model.indices(), *shaders[inst], *gbuffer, zbuffer, list);
+            }
+            if (options.deferred) {
+                shade(*gbuffer, framebuffer);
+                fragments += gbuffer->fragments;
+                shaded += gbuffer->shaded;
+            }
+            if (multisampled)
+                multisampled->resolve(framebuffer);
+
+            // the previous strip is out once this one is rendered, the last strip of the image closes its file
+            if (written.valid())
+                ok = written.get() && ok;
+            const int rows = std::min(strip, height - y);
+            const bool last = y + strip >= height;
+            written = async_task([&framebuffer, &file, rows, last] {
+                const bool ok = framebuffer.write_tga_rows(file, rows);
+                return last ? file.close() && ok : ok;
+            });
         }
+        std::cerr << "scene culling" << (strip < height ? " (summed over the strips)" : "") << ": " << culling << std::endl;
+        std::cerr << "primitive assembly: " << stats << std::endl;
+        if (options.deferred)
+            std::cerr << "deferred shading: " << fragments << " fragments passed the depth test, " << shaded << " shaded, overdraw "
+                      << (shaded ? static_cast<double>(fragments) / shaded : 0.) << "x avoided" << std::endl;
+        std::cerr << "frame " << i << " rendered in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    }
+    if (written.valid())
+        ok = written.get() && ok;
+    return ok;
+}
+
+// options start with "--", everything else is a model
+bool parse_options(const std::vector<std::string> &args, Options &options, std::vector<std::string> &models) {
+    for (const std::string &arg : args) {
+        if (arg == "--deferred")
+            options.deferred = true;
+        else if (arg == "--obj-loader=cached")
+            options.loader = Model::CACHED;
+        else if (arg == "--obj-loader=mapped")
+            options.loader = Model::MAPPED;
+        else if (arg == "--obj-loader=stream")
+            options.loader = Model::STREAM;
+        else if (arg == "--filter=nearest")
+            options.filter = Texture::NEAREST;
+        else if (arg == "--filter=bilinear")
+            options.filter = Texture::BILINEAR;
+        else if (arg == "--filter=trilinear")
+            options.filter = Texture::TRILINEAR;
+        else if (!arg.compare(0, 8, "--depth="))
+            options.depth_format = arg.substr(8);
+        else if (!arg.compare(0, 6, "--eye=") || !arg.compare(0, 9, "--center=")) {
+            vec3 &p = arg[2] == 'e' ? options.camera.eye : options.camera.center;
+            if (std::sscanf(arg.c_str() + arg.find('=') + 1, "%lf,%lf,%lf", &p.x, &p.y, &p.z) != 3) {
+                std::cerr << "expected " << arg.substr(0, arg.find('=')) << "=x,y,z" << std::endl;
+                return false;
+            }
+        } else if (!arg.compare(0, 12, "--turntable="))
+            options.turntable = std::atoi(arg.c_str() + 12);
+        else if (!arg.compare(0, 8, "--poses="))
+            options.poses = arg.substr(8);
+        else if (!arg.compare(0, 13, "--shadow-map="))
+            options.shadow_map = std::atoi(arg.c_str() + 13);
+        else if (!arg.compare(0, 13, "--normal-map="))
+            options.normal_map = std::atoi(arg.c_str() + 13) != 0;
+        else if (!arg.compare(0, 7, "--msaa="))
+            options.msaa = std::atoi(arg.c_str() + 7);
+        else if (!arg.compare(0, 7, "--size=")) {
+            if (std::sscanf(arg.c_str() + 7, "%dx%d", &options.width, &options.height) != 2) {
+                std::cerr << "expected --size=WxH" << std::endl;
+                return false;
+            }
+        } else if (!arg.compare(0, 8, "--strip="))
+            options.strip = std::atoi(arg.c_str() + 8);
+        else if (!arg.compare(0, 8, "--scene="))
+            options.scene = arg.substr(8);
+        else if (!arg.compare(0, 6, "--out="))
+            options.output = arg.substr(6);
+        else if (arg == "--serve")
+            options.serve = true;
+        else if (!arg.compare(0, 8, "--serve=")) {
+            options.serve = true;
+            options.socket = arg.substr(8);
+        } else if (!arg.compare(0, 7, "--jobs="))
+            options.jobs = std::atoi(arg.c_str() + 7);
+        else if (!arg.compare(0, 11, "--cache-mb="))
+            options.cache_mb = std::atoi(arg.c_str() + 11);
+        else if (!arg.compare(0, 8, "--trace="))
+            options.trace = arg.substr(8);
+        else if (!arg.compare(0, 2, "--")) {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        } else
+            models.push_back(arg);
+    }
+
+    // the tga header stores the size on 16 bits
+    if (options.width < 1 || options.height < 1 || options.width > 65535 || options.height > 65535) {
+        std::cerr << "image size out of range " << options.width << "x" << options.height << std::endl;
         return false;
     }
-};
+    if ((options.camera.eye - options.camera.center).norm() < 1e-9) {
+        std::cerr << "the camera is at the point it looks at" << std::endl;
+        return false;
+    }
+    if (options.msaa != 1 && options.msaa != 4 && options.msaa != 8) {
+        std::cerr << "unsupported sample count " << options.msaa << ", 1, 4 or 8" << std::endl;
+        return false;
+    }
+    if (options.msaa > 1 && options.deferred) {
+        std::cerr << "multisampling is not supported by deferred shading" << std::endl;
+        return false;
+    }
+    if (options.jobs < 1 || options.cache_mb < 0) {
+        std::cerr << "expected --jobs=n with n > 0 and --cache-mb=n with n >= 0" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// render the models and the scene of the options, the models coming from the cache if there is one
+bool run(const Options &options, const std::vector<std::string> &models, ModelCache *cache) {
+    std::vector<Camera> frames;
+    if (!cameras(options, frames)) {
+        std::cerr << "no camera to render from" << std::endl;
+        return false;
+    }
+    // the models are loaded once and concurrently, the command line ones placed as they are
+    Scene scene;
+    scene.cache = cache;
+    {
+        ProfileScope scope("load");
+        if (!options.scene.empty() && !scene.load(options.scene, options.loader))
+            return false;
+        std::vector<int> meshes;
+        if (!scene.load_meshes(models, options.loader, meshes))
+            return false;
+        for (const int mesh : meshes)
+            scene.add(mesh, mat<4, 4>::identity());
+        scene.build();
+    }
+
+    if (options.depth_format == "f64")
+        return render<DepthF64>(scene, options, frames);
+    if (options.depth_format == "f32")
+        return render<DepthF32>(scene, options, frames);
+    if (options.depth_format == "u24")
+        return render<DepthU24>(scene, options, frames);
+    if (options.depth_format == "u16")
+        return render<DepthU16>(scene, options, frames);
+    std::cerr << "unknown depth format " << options.depth_format << std::endl;
+    return false;
+}
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
+    Options options;
+    std::vector<std::string> models;
+    if (!parse_options(std::vector<std::string>(argv + 1, argv + argc), options, models))
+        return 1;
+    if (models.empty() && options.scene.empty() && !options.serve) {
         std::cerr << "Please specify a model to render, like \"../obj/diablo3_pose/diablo3_pose.obj\"" << std::endl;
+        std::cerr << "Options: --deferred                            shade each pixel once after a visibility pass" << std::endl;
+        std::cerr << "         --depth=f64|f32|u24|u16               depth buffer format" << std::endl;
+        std::cerr << "         --obj-loader=cached|mapped|stream     binary cache next to the obj (default), parallel parser or iostreams" << std::endl;
+        std::cerr << "         --filter=nearest|bilinear|trilinear   texture filtering, trilinear by default" << std::endl;
+        std::cerr << "         --eye=1,1,3 --center=0,0,0            camera position and the point it looks at" << std::endl;
+        std::cerr << "         --turntable=n                         n frames around the model, written to framebuffer_0000.tga..." << std::endl;
+        std::cerr << "         --poses=file                          one frame per line \"ex ey ez [cx cy cz]\" of the file" << std::endl;
+        std::cerr << "         --shadow-map=2048                     size of the shadow map of the light, 0 for no shadows" << std::endl;
+        std::cerr << "         --normal-map=1                        tangent space normal mapping, 0 for the interpolated normals only" << std::endl;
+        std::cerr << "         --msaa=1|4|8                          samples per pixel, shaded once per pixel, forward rendering only" << std::endl;
+        std::cerr << "         --size=5000x5000                      image size" << std::endl;
+        std::cerr << "         --strip=rows                          render the image in strips, the buffers hold one strip only" << std::endl;
+        std::cerr << "         --scene=file                          instances, one per line \"instance file.obj tx ty tz [yaw [scale]]\"" << std::endl;
+        std::cerr << "         --out=framebuffer.tga                 image file, frames numbered before the extension" << std::endl;
+        std::cerr << "         --serve[=socket]                      render jobs, one command line with --out= per line, from a unix socket or stdin" << std::endl;
+        std::cerr << "         --jobs=2                              jobs rendered at once by the server, sharing the threads" << std::endl;
+        std::cerr << "         --cache-mb=1024                       size of the models kept loaded by the server" << std::endl;
+        std::cerr << "         --trace=file                          Chrome trace of the stages, with -DGAKU_PROFILE=ON" << std::endl;
         return 1;
     }
 
-    // output image
-    TGAImage framebuffer(width, height, TGAImage::RGB);
-
-    // set mvp and viewport matrices
-    lookat(eye, center, up);
-    projection(-1.f / (eye - center).norm());
-    viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
-
-    // init zbuffer to minus infinity
-    std::vector<double> zbuffer(width * height, -std::numeric_limits<double>::max());
-
-    // load each model
-    for (int m = 1; m < argc; m++) {
-        Model model(argv[m]);
-        Shader shader(model);
-        for (int i = 0; i < model.nfaces(); i++) {
-            // set by vertex shader, used by fragment shader
-            vec4 clip_verts[3];
-            for (int j = 0; j < 3; j++) {
-                shader.vertex(i, j, clip_verts[j]);
-            }
-            triangle(clip_verts, shader, framebuffer, zbuffer);
-        }
-    }
+    bool ok;
+    if (options.serve) {
+        // every job is a command line of its own, the models stay loaded from one job to the next
+        ModelCache cache(static_cast<std::size_t>(options.cache_mb) << 20);
+        ok = serve(options.socket, options.jobs, [&cache](const std::string &line) -> std::string {
+            std::istringstream iss(line);
+            std::vector<std::string> args;
+            for (std::string arg; iss >> arg; )
+                args.push_back(arg);
+            Options job;
+            std::vector<std::string> models;
+            // jobs run at once, so each one names its own image instead of all writing the default one
+            const bool out = std::any_of(args.begin(), args.end(), [](const std::string &arg) { return !arg.compare(0, 6, "--out="); });
+            if (!parse_options(args, job, models) || job.serve || (models.empty() && job.scene.empty()) || !out)
+                return "error " + line;
+            auto start = std::chrono::steady_clock::now();
+            if (!run(job, models, &cache))
+                return "error " + line;
+            const ModelCache::Stats stats = cache.stats();
+            std::ostringstream reply;
+            reply << "ok " << job.output << " " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " ms, cache " << stats.models << " models " << (stats.bytes >> 20) << " MB, " << stats.hits << " hits "
+                  << stats.misses << " misses " << stats.evictions << " evictions";
+            return reply.str();
+        });
+    } else
+        ok = run(options, models, nullptr);
 
-    framebuffer.write_tga_file("framebuffer.tga");
-    return 0;
-}
\ No newline at end of file
+    if constexpr (profiling) {
+        std::uint64_t totals[PROFILE_COUNTERS];
+        profile_totals(totals);
+        std::cerr << "profile:";
+        for (int c = 0; c < PROFILE_COUNTERS; c++)
+            std::cerr << " " << profile_counter_name(static_cast<ProfileCounter>(c)) << " " << totals[c];
+        std::cerr << std::endl;
+    }
+    if (!options.trace.empty()) {
+        if (!profiling)
+            std::cerr << "built without GAKU_PROFILE, the trace is empty" << std::endl;
+        std::cerr << "trace file " << options.trace << " writing " << (profile_write_trace(options.trace) ? "ok" : "failed") << std::endl;
+    }
+    return ok ? 0 : 1;
+}
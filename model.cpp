@@ -1,51 +1,539 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sstream>
+#include <chrono>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "model.h"
+#include "task.h"
 
-Model::Model(const std::string filename) {
+// contents of an obj file, positions, tex coords and normals are indexed separately; faces are fanned into triangles,
+// three corners per triangle, a missing tex coord or normal index is -1
+struct ObjData {
+    std::vector<vec3> v{};
+    std::vector<vec2> vt{};
+    std::vector<vec3> vn{};
+    std::vector<int> fv{}, fvt{}, fvn{};
+    int bad_faces = 0;
+};
+
+// line by line with iostreams, fallback when the file can not be mapped
+static bool parse_obj_stream(const std::string filename, ObjData &obj, size_t &bytes) {
     std::ifstream in;
     in.open(filename, std::ifstream::in);
-    if (in.fail()) return;
+    if (in.fail()) return false;
     std::string line;
     while (!in.eof()) {
         std::getline(in, line);
+        bytes += line.size() + 1;
         std::istringstream iss(line.c_str());
         char trash;
         if (!line.compare(0, 2, "v ")) {
             iss >> trash;
             vec3 v;
             for (int i=0;i<3;i++) iss >> v[i];
-            verts.push_back(v);
+            obj.v.push_back(v);
         } else if (!line.compare(0, 3, "vn ")) {
             iss >> trash >> trash;
             vec3 n;
             for (int i=0;i<3;i++) iss >> n[i];
-            norms.push_back(n.normalized());
+            obj.vn.push_back(n.normalized());
         } else if (!line.compare(0, 3, "vt ")) {
             iss >> trash >> trash;
             vec2 uv;
             for (int i=0;i<2;i++) iss >> uv[i];
-            tex_coord.push_back({uv.x, 1-uv.y});
+            obj.vt.push_back({uv.x, 1-uv.y});
         }  else if (!line.compare(0, 2, "f ")) {
             int f,t,n;
             iss >> trash;
-            int cnt = 0;
+            std::vector<int> corners;
             while (iss >> f >> trash >> t >> trash >> n) {
-                facet_vrt.push_back(--f);
-                facet_tex.push_back(--t);
-                facet_nrm.push_back(--n);
-                cnt++;
+                corners.push_back(--f);
+                corners.push_back(--t);
+                corners.push_back(--n);
+            }
+            const int cnt = corners.size()/3;
+            if (cnt<3) {
+                obj.bad_faces++;
+                continue;
+            }
+            // polygons are fanned around their first corner
+            for (int i=1; i+1<cnt; i++) {
+                for (int c : {0, i, i+1}) {
+                    obj.fv.push_back(corners[c*3]);
+                    obj.fvt.push_back(corners[c*3+1]);
+                    obj.fvn.push_back(corners[c*3+2]);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// arrays of the vertex buffer of a model built from an obj
+struct VertexArrays {
+    std::vector<vec3> verts;
+    std::vector<vec2> tex_coord;
+    std::vector<vec3> norms;
+    std::vector<vec4> tangents;
+    std::vector<int> facet_vrt;
+};
+
+// read-only mapping of a whole file
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+    MappedFile(const std::string filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd<0) return;
+        struct stat st;
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size>0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p!=MAP_FAILED) {
+                data = static_cast<const char*>(p);
+                size = st.st_size;
+                madvise(p, size, MADV_WILLNEED);
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile() { if (data) munmap(const_cast<char*>(data), size); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+static const char *skip_blanks(const char *p, const char *end) {
+    while (p<end && (*p==' ' || *p=='\t')) p++;
+    return p;
+}
+
+static const char *next_line(const char *p, const char *end) {
+    const char *eol = static_cast<const char*>(std::memchr(p, '\n', end-p));
+    return eol ? eol+1 : end;
+}
+
+static const char *parse_int(const char *p, const char *end, int &x) {
+    bool neg = p<end && *p=='-';
+    if (neg || (p<end && *p=='+')) p++;
+    const char *start = p;
+    long long v = 0;
+    for (; p<end && *p>='0' && *p<='9' && v<(1ll<<40); p++) v = v*10 + (*p-'0');
+    x = p==start ? 0 : static_cast<int>(neg ? -v : v);
+    return p;
+}
+
+// decimal mantissa and exponent, exact whenever the mantissa fits in 53 bits and the power of ten is exact (|exponent| <= 22),
+// that is for every number an exporter writes with up to 15 significant digits; the other ones go through from_chars
+static const char *parse_double(const char *p, const char *end, double &x) {
+    static constexpr double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *start = p;
+    bool neg = p<end && *p=='-';
+    if (neg || (p<end && *p=='+')) p++;
+    std::uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; p<end && *p>='0' && *p<='9'; p++, digits++) mantissa = mantissa*10 + (*p-'0');
+    if (p<end && *p=='.')
+        for (p++; p<end && *p>='0' && *p<='9'; p++, digits++, exponent--) mantissa = mantissa*10 + (*p-'0');
+    if (p<end && (*p=='e' || *p=='E')) {
+        int e;
+        p = parse_int(p+1, end, e);
+        exponent += e;
+    }
+    if (digits<=15 && exponent>=-22 && exponent<=22) {
+        x = exponent<0 ? mantissa/pow10[-exponent] : mantissa*pow10[exponent];
+        if (neg) x = -x;
+        return p;
+    }
+    if (*start=='+') start++;
+    return std::from_chars(start, end, x).ptr;
+}
+
+// element counts of a chunk of lines, the first pass
+struct ObjCounts {
+    int v = 0, vt = 0, vn = 0, triangles = 0, bad_faces = 0;
+};
+
+static ObjCounts count_obj_chunk(const char *p, const char *end) {
+    ObjCounts n;
+    for (; p<end; p = next_line(p, end)) {
+        p = skip_blanks(p, end);
+        if (end-p<2) continue;
+        if (p[0]=='v' && (p[1]==' ' || p[1]=='\t')) n.v++;
+        else if (p[0]=='v' && p[1]=='t') n.vt++;
+        else if (p[0]=='v' && p[1]=='n') n.vn++;
+        else if (p[0]=='f' && (p[1]==' ' || p[1]=='\t')) {
+            int corners = 0;
+            for (p = skip_blanks(p+1, end); p<end && *p!='\n' && *p!='\r'; p = skip_blanks(p, end)) {
+                corners++;
+                while (p<end && *p!=' ' && *p!='\t' && *p!='\n' && *p!='\r') p++;
             }
-            if (3!=cnt) {
-                std::cerr << "Error: the obj file is supposed to be triangulated" << std::endl;
-                return;
+            if (corners>=3) n.triangles += corners-2;
+            else n.bad_faces++;
+        }
+    }
+    return n;
+}
+
+// second pass, the chunk writes its elements in place starting at the counts of the previous chunks;
+// relative (negative) face indices refer to the elements read so far, the base counts make them absolute
+static void parse_obj_chunk(const char *p, const char *end, ObjCounts at, ObjData &obj) {
+    for (; p<end; p = next_line(p, end)) {
+        p = skip_blanks(p, end);
+        if (end-p<2) continue;
+        if (p[0]=='v' && (p[1]==' ' || p[1]=='\t')) {
+            vec3 &v = obj.v[at.v++];
+            p++;
+            for (int i=0;i<3;i++) p = parse_double(skip_blanks(p, end), end, v[i]);
+        } else if (p[0]=='v' && p[1]=='t') {
+            vec2 uv;
+            p += 2;
+            for (int i=0;i<2;i++) p = parse_double(skip_blanks(p, end), end, uv[i]);
+            obj.vt[at.vt++] = {uv.x, 1-uv.y};
+        } else if (p[0]=='v' && p[1]=='n') {
+            vec3 n;
+            p += 2;
+            for (int i=0;i<3;i++) p = parse_double(skip_blanks(p, end), end, n[i]);
+            obj.vn[at.vn++] = n.normalized();
+        } else if (p[0]=='f' && (p[1]==' ' || p[1]=='\t')) {
+            // corners v, v/vt, v//vn or v/vt/vn
+            int first[3], prev[3], cnt = 0;
+            for (p = skip_blanks(p+1, end); p<end && *p!='\n' && *p!='\r'; p = skip_blanks(p, end), cnt++) {
+                int corner[3] = {0, 0, 0};
+                const int count[3] = {at.v, at.vt, at.vn};
+                for (int k=0; k<3; k++) {
+                    if (k && !(p<end && *p=='/')) break;
+                    if (k) p++;
+                    if (p<end && *p!='/') p = parse_int(p, end, corner[k]);
+                }
+                while (p<end && *p!=' ' && *p!='\t' && *p!='\n' && *p!='\r') p++;
+                for (int k=0; k<3; k++)
+                    corner[k] = corner[k]>0 ? corner[k]-1 : corner[k]<0 ? count[k]+corner[k] : -1;
+                if (!cnt) std::memcpy(first, corner, sizeof corner);
+                if (cnt>=2) {
+                    // polygons are fanned around their first corner
+                    const int t = at.triangles++ * 3;
+                    const int *fan[3] = {first, prev, corner};
+                    for (int k=0; k<3; k++) {
+                        obj.fv [t+k] = fan[k][0];
+                        obj.fvt[t+k] = fan[k][1];
+                        obj.fvn[t+k] = fan[k][2];
+                    }
+                }
+                std::memcpy(prev, corner, sizeof corner);
             }
         }
     }
-    std::cerr << "# v# " << nverts() << " f# "  << nfaces() << " vt# " << tex_coord.size() << " vn# " << norms.size() << std::endl;
-    load_texture(filename, "_diffuse.tga",    diffusemap );
-    load_texture(filename, "_nm_tangent.tga", normalmap  );
-    load_texture(filename, "_spec.tga",       specularmap);
+}
+
+// memory-mapped file cut at line ends into chunks of about 1 MB parsed in parallel: a first pass counts the elements of each chunk,
+// so that the second one writes them straight into arrays sized once for the whole file
+static bool parse_obj_mapped(const std::string filename, ObjData &obj, size_t &bytes, int &nchunks) {
+    const MappedFile file(filename);
+    if (!file.data) return false;
+    bytes = file.size;
+    const char *end = file.data + file.size;
+    std::vector<const char*> bounds{file.data};
+    for (const char *p = file.data + (1<<20); p<end; p += 1<<20) {
+        p = next_line(p, end);
+        if (p<end) bounds.push_back(p);
+    }
+    bounds.push_back(end);
+    nchunks = bounds.size()-1;
+
+    std::vector<ObjCounts> at(nchunks+1);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i=0; i<nchunks; i++)
+        at[i+1] = count_obj_chunk(bounds[i], bounds[i+1]);
+    for (int i=0; i<nchunks; i++) {
+        at[i+1].v += at[i].v;
+        at[i+1].vt += at[i].vt;
+        at[i+1].vn += at[i].vn;
+        at[i+1].triangles += at[i].triangles;
+        at[i+1].bad_faces += at[i].bad_faces;
+    }
+    obj.bad_faces = at[nchunks].bad_faces;
+    obj.v.resize(at[nchunks].v);
+    obj.vt.resize(at[nchunks].vt);
+    obj.vn.resize(at[nchunks].vn);
+    obj.fv.resize(at[nchunks].triangles*3);
+    obj.fvt.resize(at[nchunks].triangles*3);
+    obj.fvn.resize(at[nchunks].triangles*3);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i=0; i<nchunks; i++)
+        parse_obj_chunk(bounds[i], bounds[i+1], at[i], obj);
+    return true;
+}
+
+// textures of a model, next to the obj with these suffixes
+static const char *const texture_suffix[3] = {"_diffuse.tga", "_nm_tangent.tga", "_spec.tga"};
+
+static std::string texture_file(const std::string &filename, const char *suffix) {
+    size_t dot = filename.find_last_of(".");
+    return dot==std::string::npos ? std::string() : filename.substr(0,dot) + suffix;
+}
+
+// size and modification time (ns) of a source file of the model, size -1 if it does not exist
+static void source_stamp(const std::string &filename, std::int64_t stamp[2]) {
+    struct stat st;
+    bool ok = !filename.empty() && !stat(filename.c_str(), &st);
+    stamp[0] = ok ? st.st_size : -1;
+    stamp[1] = ok ? st.st_mtim.tv_sec*1000000000ll + st.st_mtim.tv_nsec : 0;
+}
+
+// binary cache of a model, written next to the obj: the vertex buffer and the textures with their mip chains in their in-memory layout,
+// each section 64-byte aligned so that the vertex and index sections of the mapped file are used in place and the textures copied
+// section by section, without any parsing or decoding
+struct CacheHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t layout;                  // endianness and sizes of the stored types, the cache is only valid on a matching host
+    std::int64_t source[4][2];             // stamps of the obj and of the textures it was built from
+    std::uint64_t size;                    // of the whole file
+    std::uint64_t nverts, nindices;
+    std::uint64_t verts, tex_coord, norms, tangents, indices; // section offsets
+    struct { std::uint32_t width, height, bytespp, pad; std::uint64_t offset; } texture[3];
+};
+
+static constexpr char cache_magic[8] = {'g','a','k','u','m','s','h','\0'};
+static constexpr std::uint32_t cache_version = 3;
+// sizes of the stored types, and in the low byte the first byte of cache_version in memory (1 on little-endian hosts)
+static const std::uint32_t cache_layout = (std::uint32_t)sizeof(vec3)<<24 | (std::uint32_t)sizeof(vec2)<<16 | (std::uint32_t)sizeof(int)<<8 | *(const std::uint8_t*)&cache_version;
+
+static std::uint64_t cache_align(const std::uint64_t offset) {
+    return (offset + 63) & ~std::uint64_t(63);
+}
+
+// stamps of an obj and of its textures
+static void source_stamps(const std::string &filename, std::int64_t stamps[4][2]) {
+    source_stamp(filename, stamps[0]);
+    for (int i=0; i<3; i++)
+        source_stamp(texture_file(filename, texture_suffix[i]), stamps[i+1]);
+}
+
+Model::Model(const std::string filename, const Loader loader) : source(filename) {
+    // the sources are stamped before they are read, so that a change while loading invalidates the cache written after
+    source_stamps(filename, stamps);
+    const std::string cache = filename + ".cache";
+    if (loader==CACHED && read_cache(cache, stamps)) return;
+
+    // the textures are decoded in tasks of their own while the obj is parsed
+    std::future<Texture> textures[3];
+    for (int i=0; i<3; i++)
+        textures[i] = async_task(load_texture, filename, texture_suffix[i]);
+    ObjData obj;
+    size_t bytes = 0;
+    int nchunks = 0;
+    auto start = std::chrono::steady_clock::now();
+    if (!(loader!=STREAM && parse_obj_mapped(filename, obj, bytes, nchunks)) && !parse_obj_stream(filename, obj, bytes)) return;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "# obj " << bytes/1e6 << " MB parsed in " << ms << " ms, " << bytes/1e3/ms << " MB/s ("
+              << (nchunks ? std::to_string(nchunks) + " mapped chunks" : std::string("stream")) << ")" << std::endl;
+    if (obj.bad_faces)
+        std::cerr << "Error: " << obj.bad_faces << " faces with less than 3 vertices skipped" << std::endl;
+    auto arrays = std::make_shared<VertexArrays>();
+    build_vertex_buffer(*arrays, obj.v, obj.vt, obj.vn, obj.fv, obj.fvt, obj.fvn);
+    verts = arrays->verts;
+    tex_coord = arrays->tex_coord;
+    norms = arrays->norms;
+    facet_vrt = arrays->facet_vrt;
+    arrays->tangents = build_tangents();
+    tangents = arrays->tangents;
+    vertex_buffer = std::move(arrays);
+    std::cerr << "# v# " << obj.v.size() << " f# "  << nfaces() << " vt# " << obj.vt.size() << " vn# " << obj.vn.size() << " unique vertices# " << nverts() << std::endl;
+    diffusemap  = textures[0].get();
+    normalmap   = textures[1].get();
+    specularmap = textures[2].get();
+    if (loader==CACHED)
+        std::cerr << "cache file " << cache << " writing " << (write_cache(cache, stamps) ? "ok" : "failed") << std::endl;
+}
+
+bool Model::read_cache(const std::string &cachefile, const std::int64_t stamps[4][2]) {
+    auto start = std::chrono::steady_clock::now();
+    auto mapping = std::make_shared<const MappedFile>(cachefile);
+    const MappedFile &file = *mapping;
+    CacheHeader h;
+    if (!file.data || file.size<sizeof(h)) return false;
+    std::memcpy(&h, file.data, sizeof(h));
+    if (std::memcmp(h.magic, cache_magic, sizeof(h.magic)) || h.version!=cache_version || h.layout!=cache_layout || h.size!=file.size ||
+        std::memcmp(h.source, stamps, sizeof(h.source))) {
+        std::cerr << "cache file " << cachefile << " is stale" << std::endl;
+        return false;
+    }
+    // every section must lie inside the file
+    auto inside = [&](const std::uint64_t offset, const std::uint64_t bytes) { return offset<=h.size && bytes<=h.size-offset; };
+    bool ok = h.nverts<(1u<<31) && h.nindices<(1u<<31) && h.nindices%3==0 && inside(h.verts, h.nverts*sizeof(vec3)) &&
+              inside(h.tex_coord, h.nverts*sizeof(vec2)) && inside(h.norms, h.nverts*sizeof(vec3)) &&
+              inside(h.tangents, h.nverts*sizeof(vec4)) && inside(h.indices, h.nindices*sizeof(int));
+    Texture textures[3];
+    for (int i=0; i<3; i++) {
+        ok = ok && h.texture[i].width<65536 && h.texture[i].height<65536 && h.texture[i].bytespp<=4;
+        if (ok) textures[i] = Texture(h.texture[i].width, h.texture[i].height, h.texture[i].bytespp);
+        ok = ok && inside(h.texture[i].offset, textures[i].texels.size()*sizeof(std::uint32_t));
+    }
+    if (!ok) {
+        std::cerr << "cache file " << cachefile << " is corrupted" << std::endl;
+        return false;
+    }
+    const int *indices = reinterpret_cast<const int*>(file.data + h.indices);
+    for (std::uint64_t i=0; i<h.nindices; i++)
+        if (indices[i]<0 || std::uint64_t(indices[i])>=h.nverts) {
+            std::cerr << "cache file " << cachefile << " is corrupted" << std::endl;
+            return false;
+        }
+    // the mapping is private and the cache is only ever replaced by a rename, so the sections stay as they are while the model uses them
+    verts = {reinterpret_cast<const vec3*>(file.data + h.verts), h.nverts};
+    tex_coord = {reinterpret_cast<const vec2*>(file.data + h.tex_coord), h.nverts};
+    norms = {reinterpret_cast<const vec3*>(file.data + h.norms), h.nverts};
+    tangents = {reinterpret_cast<const vec4*>(file.data + h.tangents), h.nverts};
+    facet_vrt = {indices, h.nindices};
+    vertex_buffer = std::move(mapping);
+    Texture *const maps[3] = {&diffusemap, &normalmap, &specularmap};
+    for (int i=0; i<3; i++) {
+        std::memcpy(textures[i].texels.data(), file.data + h.texture[i].offset, textures[i].texels.size()*sizeof(std::uint32_t));
+        *maps[i] = std::move(textures[i]);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "# cache " << file.size/1e6 << " MB loaded in " << ms << " ms, f# " << nfaces() << " unique vertices# " << nverts() << std::endl;
+    return true;
+}
+
+// written to a temporary file renamed over the cache, so that concurrent writers never see a partial one
+bool Model::write_cache(const std::string &cachefile, const std::int64_t stamps[4][2]) const {
+    CacheHeader h{};
+    std::memcpy(h.magic, cache_magic, sizeof(h.magic));
+    h.version = cache_version;
+    h.layout = cache_layout;
+    std::memcpy(h.source, stamps, sizeof(h.source));
+    h.nverts = verts.size();
+    h.nindices = facet_vrt.size();
+    h.verts = cache_align(sizeof(h));
+    h.tex_coord = cache_align(h.verts + h.nverts*sizeof(vec3));
+    h.norms = cache_align(h.tex_coord + h.nverts*sizeof(vec2));
+    h.tangents = cache_align(h.norms + h.nverts*sizeof(vec3));
+    h.indices = cache_align(h.tangents + h.nverts*sizeof(vec4));
+    std::uint64_t end = h.indices + h.nindices*sizeof(int);
+    const Texture *const maps[3] = {&diffusemap, &normalmap, &specularmap};
+    for (int i=0; i<3; i++) {
+        const Texture &tex = *maps[i];
+        h.texture[i] = {std::uint32_t(tex.width()), std::uint32_t(tex.height()), std::uint32_t(tex.bytespp), 0, cache_align(end)};
+        end = h.texture[i].offset + tex.texels.size()*sizeof(std::uint32_t);
+    }
+    h.size = end;
+
+    std::vector<char> out(h.size);
+    std::memcpy(out.data(), &h, sizeof(h));
+    std::memcpy(out.data() + h.verts, verts.data(), h.nverts*sizeof(vec3));
+    std::memcpy(out.data() + h.tex_coord, tex_coord.data(), h.nverts*sizeof(vec2));
+    std::memcpy(out.data() + h.norms, norms.data(), h.nverts*sizeof(vec3));
+    std::memcpy(out.data() + h.tangents, tangents.data(), h.nverts*sizeof(vec4));
+    std::memcpy(out.data() + h.indices, facet_vrt.data(), h.nindices*sizeof(int));
+    for (int i=0; i<3; i++)
+        std::memcpy(out.data() + h.texture[i].offset, maps[i]->texels.data(), maps[i]->texels.size()*sizeof(std::uint32_t));
+
+    // one temporary file per writer: the threads of a process can load the same obj under different names at once
+    const std::string tmp = cachefile + "." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::ofstream f(tmp, std::ios::binary);
+    f.write(out.data(), out.size());
+    f.close();
+    if (!f.good() || std::rename(tmp.c_str(), cachefile.c_str())) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// merge the position/uv/normal triplets of the triangle corners into an indexed vertex buffer, each distinct triplet becomes one vertex;
+// triangles with out of range indices are dropped, a missing tex coord or normal is (0, 0) or (0, 0, 1)
+void Model::build_vertex_buffer(VertexArrays &arrays, const std::vector<vec3> &v, const std::vector<vec2> &vt, const std::vector<vec3> &vn,
+                                const std::vector<int> &facet_v, const std::vector<int> &facet_vt, const std::vector<int> &facet_vn) {
+    auto &[verts, tex_coord, norms, tangents, facet_vrt] = arrays;
+    // vertices made of each position, chained through next
+    std::vector<int> first(v.size(), -1), next, src_vt, src_vn;
+    int dropped = 0;
+    facet_vrt.reserve(facet_v.size());
+    for (size_t t=0; t<facet_v.size(); t+=3) {
+        bool valid = true;
+        for (size_t i=t; i<t+3; i++)
+            valid = valid && facet_v[i]>=0 && facet_v[i]<(int)v.size() && facet_vt[i]>=-1 && facet_vt[i]<(int)vt.size() && facet_vn[i]>=-1 && facet_vn[i]<(int)vn.size();
+        if (!valid) {
+            dropped++;
+            continue;
+        }
+        for (size_t i=t; i<t+3; i++) {
+            int id = first[facet_v[i]];
+            while (id>=0 && (src_vt[id]!=facet_vt[i] || src_vn[id]!=facet_vn[i])) id = next[id];
+            if (id<0) {
+                id = verts.size();
+                verts.push_back(v[facet_v[i]]);
+                tex_coord.push_back(facet_vt[i]<0 ? vec2{0, 0} : vt[facet_vt[i]]);
+                norms.push_back(facet_vn[i]<0 ? vec3{0, 0, 1} : vn[facet_vn[i]]);
+                src_vt.push_back(facet_vt[i]);
+                src_vn.push_back(facet_vn[i]);
+                next.push_back(first[facet_v[i]]);
+                first[facet_v[i]] = id;
+            }
+            facet_vrt.push_back(id);
+        }
+    }
+    if (dropped)
+        std::cerr << "Error: " << dropped << " triangles with out of range indices skipped" << std::endl;
+}
+
+// tangent frames in the way of MikkTSpace: per triangle the directions of growing u and v on its plane, normalized and weighted by the
+// angle of each corner, are summed over the triangles of a vertex; the tangent is made orthogonal to the normal of the vertex and the
+// bitangent is kept as a sign only, the shaders rebuild it from the interpolated normal and tangent
+std::vector<vec4> Model::build_tangents() const {
+    std::vector<vec3> tan(verts.size(), {0, 0, 0}), bitan(verts.size(), {0, 0, 0});
+    for (int f=0; f<nfaces(); f++) {
+        const vec3 e1 = vert(f, 1) - vert(f, 0), e2 = vert(f, 2) - vert(f, 0);
+        const vec2 d1 = uv(f, 1) - uv(f, 0), d2 = uv(f, 2) - uv(f, 0);
+        const double det = d1.x*d2.y - d2.x*d1.y;
+        if (std::abs(det)<1e-12) continue; // no uv mapping
+        const vec3 t = (e1*d2.y - e2*d1.y)/det, b = (e2*d1.x - e1*d2.x)/det;
+        if (t.norm()<1e-12 || b.norm()<1e-12) continue;
+        for (int k=0; k<3; k++) {
+            const vec3 a = vert(f, (k+1)%3) - vert(f, k), c = vert(f, (k+2)%3) - vert(f, k);
+            const double la = a.norm(), lc = c.norm();
+            if (la<1e-12 || lc<1e-12) continue;
+            const double angle = std::acos(std::clamp(a*c/(la*lc), -1., 1.));
+            tan[index(f, k)] = tan[index(f, k)] + t.normalized()*angle;
+            bitan[index(f, k)] = bitan[index(f, k)] + b.normalized()*angle;
+        }
+    }
+    std::vector<vec4> tangents(verts.size());
+    for (int i=0; i<nverts(); i++) {
+        const vec3 &n = norms[i];
+        vec3 t = tan[i] - n*(n*tan[i]);
+        // no tangent from the faces, any direction orthogonal to the normal
+        if (t.norm()<1e-9)
+            t = cross(n, std::abs(n.x)<.9 ? vec3{1, 0, 0} : vec3{0, 1, 0});
+        t = t.normalized();
+        tangents[i] = {t.x, t.y, t.z, cross(n, t)*bitan[i]<0 ? -1. : 1.};
+    }
+    return tangents;
+}
+
+std::size_t Model::size() const {
+    std::size_t bytes = verts.size()*sizeof(vec3) + tex_coord.size()*sizeof(vec2) + norms.size()*sizeof(vec3) + tangents.size()*sizeof(vec4) +
+                        facet_vrt.size()*sizeof(int);
+    for (const Texture *tex : {&diffusemap, &normalmap, &specularmap})
+        bytes += tex->texels.size()*sizeof(std::uint32_t);
+    return bytes;
+}
+
+bool Model::changed() const {
+    std::int64_t now[4][2];
+    source_stamps(source, now);
+    return std::memcmp(now, stamps, sizeof(now));
 }
 
 int Model::nverts() const {
@@ -64,23 +552,42 @@ vec3 Model::vert(const int iface, const int nthvert) const {
     return verts[facet_vrt[iface*3+nthvert]];
 }
 
-void Model::load_texture(std::string filename, const std::string suffix, TGAImage &img) {
-    size_t dot = filename.find_last_of(".");
-    if (dot==std::string::npos) return;
-    std::string texfile = filename.substr(0,dot) + suffix;
-    std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
+// runs concurrently with the other textures, the message is written at once so that the lines do not mix
+Texture Model::load_texture(const std::string filename, const char *suffix) {
+    std::string texfile = texture_file(filename, suffix);
+    if (texfile.empty()) return Texture();
+    TGAImage img;
+    const bool ok = img.read_tga_file(texfile.c_str());
+    std::cerr << "texture file " + texfile + " loading " + (ok ? "ok" : "failed") + "\n";
+    return Texture(img);
 }
 
 vec3 Model::normal(const vec2 &uvf) const {
-    TGAColor c = normalmap.get(uvf[0]*normalmap.width(), uvf[1]*normalmap.height());
+    TGAColor c = normalmap.nearest(uvf[0], uvf[1]);
     return vec3{(double)c[2],(double)c[1],(double)c[0]}*2./255. - vec3{1,1,1};
 }
 
+int Model::index(const int iface, const int nthvert) const {
+    return facet_vrt[iface*3+nthvert];
+}
+
+vec2 Model::uv(const int i) const {
+    return tex_coord[i];
+}
+
 vec2 Model::uv(const int iface, const int nthvert) const {
-    return tex_coord[facet_tex[iface*3+nthvert]];
+    return tex_coord[facet_vrt[iface*3+nthvert]];
+}
+
+vec4 Model::tangent(const int i) const {
+    return tangents[i];
+}
+
+vec3 Model::normal(const int i) const {
+    return norms[i];
 }
 
 vec3 Model::normal(const int iface, const int nthvert) const {
-    return norms[facet_nrm[iface*3+nthvert]];
+    return norms[facet_vrt[iface*3+nthvert]];
 }
 
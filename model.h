@@ -1,29 +1,55 @@
+#pragma once
+#include <memory>
+#include <span>
 #include <vector>
 #include <string>
 #include "geometry.h"
-#include "tgaimage.h"
+#include "texture.h"
+
+struct VertexArrays;
 
 class Model {
-    std::vector<vec3> verts{};     // array of vertices
-    std::vector<vec2> tex_coord{}; // per-vertex array of tex coords
-    std::vector<vec3> norms{};     // per-vertex array of normal vectors
-    std::vector<int> facet_vrt{};
-    std::vector<int> facet_tex{};  // per-triangle indices in the above arrays
-    std::vector<int> facet_nrm{};
-    TGAImage diffusemap{};         // diffuse color texture
-    TGAImage normalmap{};          // normal map texture
-    TGAImage specularmap{};        // specular map texture
-    void load_texture(const std::string filename, const std::string suffix, TGAImage &img);
+    std::span<const vec3> verts{};     // array of vertices, one per distinct position/uv/normal triplet of the obj
+    std::span<const vec2> tex_coord{}; // per-vertex array of tex coords
+    std::span<const vec3> norms{};     // per-vertex array of normal vectors
+    std::span<const vec4> tangents{};  // per-vertex tangent along u orthogonal to the normal, w is the sign of the bitangent along v
+    std::span<const int> facet_vrt{};  // per-triangle indices in the above arrays
+    std::shared_ptr<const void> vertex_buffer{}; // what the arrays above point into: the arrays built from the obj, or the mapped cache file
+    Texture diffusemap{};          // diffuse color texture
+    Texture normalmap{};           // normal map texture
+    Texture specularmap{};         // specular map texture
+    std::string source{};          // obj file the model was loaded from
+    std::int64_t stamps[4][2]{};   // size and modification time of the obj and the textures when they were loaded
+    static Texture load_texture(const std::string filename, const char *suffix);
+    bool read_cache(const std::string &cachefile, const std::int64_t stamps[4][2]);
+    bool write_cache(const std::string &cachefile, const std::int64_t stamps[4][2]) const;
+    static void build_vertex_buffer(VertexArrays &arrays, const std::vector<vec3> &v, const std::vector<vec2> &vt, const std::vector<vec3> &vn,
+                                    const std::vector<int> &facet_v, const std::vector<int> &facet_vt, const std::vector<int> &facet_vn);
+    std::vector<vec4> build_tangents() const;
 public:
-    Model(const std::string filename);
+    // CACHED: map the binary cache next to the obj if it is up to date, the vertex buffer is read in place and the textures are copied,
+    // otherwise parse the mapped obj in parallel and write the cache;
+    // MAPPED: always parse the mapped obj; STREAM: parse it with iostreams
+    enum Loader { CACHED, MAPPED, STREAM };
+    Model(const std::string filename, const Loader loader=CACHED);
+    // bytes of the vertex buffer and of the textures
+    std::size_t size() const;
+    // whether the obj or one of the textures changed on disk since the model was loaded
+    bool changed() const;
     int nverts() const;
     int nfaces() const;
+    int index(const int iface, const int nthvert) const;   // vertex of a triangle corner
+    std::span<const int> indices() const { return facet_vrt; }
+    vec3 normal(const int i) const;
     vec3 normal(const int iface, const int nthvert) const; // per triangle corner normal vertex
     vec3 normal(const vec2 &uv) const;                     // fetch the normal vector from the normal map texture
+    vec4 tangent(const int i) const;                       // tangent frame of a vertex, the bitangent is w * cross(normal, tangent)
     vec3 vert(const int i) const;
     vec3 vert(const int iface, const int nthvert) const;
+    vec2 uv(const int i) const;
     vec2 uv(const int iface, const int nthvert) const;
-    const TGAImage& diffuse()  const { return diffusemap;  }
-    const TGAImage& specular() const { return specularmap; }
+    const Texture& diffuse()  const { return diffusemap;  }
+    const Texture& specular() const { return specularmap; }
+    const Texture& normal_map() const { return normalmap; }
 };
 
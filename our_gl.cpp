@@ -1,9 +1,23 @@
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <type_traits>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 # include "our_gl.h"
+#include "pipeline.h"
+#include "profile.h"
 
-// model + view, projection, viewport transformation matrix
-mat<4, 4> ModelView;
-mat<4, 4> Projection;
-mat<4, 4> Viewport;
+// model + view, projection, viewport transformation matrix, per thread so that concurrent renders each have their own camera;
+// they are read by the thread that sets up the shaders and calls draw
+thread_local mat<4, 4> ModelView;
+thread_local mat<4, 4> Projection;
+thread_local mat<4, 4> Viewport;
 
 // model + view transformation
 void lookat(const vec3 eye, const vec3 center, const vec3 up) {
@@ -29,53 +43,518 @@ void viewport(const int x, const int y, const int w, const int h) {
     Viewport = {{{w / 2., 0, 0, x + w / 2.}, {0, h / 2., 0, y + h / 2.}, {0, 0, 1, 0}, {0, 0, 0, 1}}};
 }
 
-// compute barycentric coordinate of P in triangle tri
-vec3 barycentric(const vec2 tri[3], const vec2 P) {
-    // Mu = p -> u = M.inverse * p, where M is formed by triangle coordinates (columns), u is barycentric coordinates
-    mat<3, 3> M = {{embed<3>(tri[0]), embed<3>(tri[1]), embed<3>(tri[2])}};
-    // if determinant of M is 0, then the triangle is degenerate (A, B, C are in the same line)
-    if (M.det() < 1e-3)
-        // return an arbitrary negative value and the shader will ignore it
-        return {-1, 1, 1};
-    return M.invert_transpose() * embed<3>(P);
+// per lane fallback for shaders without a packet version
+void IShader::fragment_packet(const int iface, const FragmentPacket &frag, int &mask, TGAColor color[packet_size]) const {
+    for (int l = 0; l < packet_size; l++) {
+        // fragment shader can discard the pixel
+        if (mask >> l & 1 && fragment(iface, {frag.bar[0][l], frag.bar[1][l], frag.bar[2][l]}, color[l]))
+            mask &= ~(1 << l);
+    }
 }
 
-// draw triangle
-void triangle(const vec4 clip_verts[3], IShader &shader, TGAImage &image, std::vector<double> &zbuffer) {
-    // canonical frustum -> screen space
-    vec4 pts[3] = {Viewport * clip_verts[0], Viewport * clip_verts[1], Viewport * clip_verts[2]};
-    // 3d homogeneous -> 2d cartesian
-    vec2 pts_xy[3] = {proj<2>(pts[0] / pts[0][3]), proj<2>(pts[1] / pts[1][3]), proj<2>(pts[2] / pts[2][3])};
+// set up triangle from its screen space vertices: bounding box, edge equations and fill rule, once per triangle
+Cull setup_triangle(const vec4 pts[3], const int iface, const int width, const int height, Triangle &tri, const double margin) {
+    // 3d homogeneous -> 2d cartesian, snapped to a 1/256 pixel grid so that edge values are exact in double precision
+    vec2 pts_xy[3];
+    for (int i = 0; i < 3; i++) {
+        pts_xy[i] = {std::round(pts[i][0] / pts[i][3] * 256) / 256, std::round(pts[i][1] / pts[i][3] * 256) / 256};
+        tri.depth[i] = pts[i][2] / pts[i][3];
+    }
+    tri.zmax = std::max({tri.depth[0], tri.depth[1], tri.depth[2]});
+
+    // twice the signed area, degenerate (A, B, C are in the same line) and clockwise triangles are not drawn
+    double area = (pts_xy[1].x - pts_xy[0].x) * (pts_xy[2].y - pts_xy[0].y) - (pts_xy[2].x - pts_xy[0].x) * (pts_xy[1].y - pts_xy[0].y);
+    if (area <= -1e-3)
+        return BACKFACE;
+    if (!(area >= 1e-3))
+        return DEGENERATE;
+    tri.iface = iface;
+    tri.clipped = false;
+    tri.inv_area = 1 / area;
+
+    // bounding box of the pixel centers covered by the triangle (or with samples covered), clamped to the screen
+    double bboxmin[2] = {std::min({pts_xy[0].x, pts_xy[1].x, pts_xy[2].x}) - margin, std::min({pts_xy[0].y, pts_xy[1].y, pts_xy[2].y}) - margin};
+    double bboxmax[2] = {std::max({pts_xy[0].x, pts_xy[1].x, pts_xy[2].x}) + margin, std::max({pts_xy[0].y, pts_xy[1].y, pts_xy[2].y}) + margin};
+    const int size[2] = {width, height};
+    for (int j = 0; j < 2; j++) {
+        if (bboxmax[j] < 0 || bboxmin[j] > size[j] - 1)
+            return OUTSIDE;
+        tri.bboxmin[j] = static_cast<int>(std::ceil(std::max(0., bboxmin[j])));
+        tri.bboxmax[j] = static_cast<int>(std::floor(std::min(size[j] - 1., bboxmax[j])));
+        if (tri.bboxmin[j] > tri.bboxmax[j])
+            return OUTSIDE;
+    }
 
-    // set bounding box of the triangle
-    int bboxmin[2] = {image.width() - 1, image.height() - 1};
-    int bboxmax[2] = {0, 0};
     for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 2; j++) {
-            bboxmin[j] = std::min(bboxmin[j], static_cast<int>(pts_xy[i][j]));
-            bboxmax[j] = std::max(bboxmax[j], static_cast<int>(pts_xy[i][j]));
+        // edge opposite to vertex i, its value at P is twice the signed area of (P, B, C), i.e. the unnormalized barycentric coordinate
+        const vec2 &b = pts_xy[(i + 1) % 3];
+        const vec2 &c = pts_xy[(i + 2) % 3];
+        tri.edge[i] = {b.y - c.y, c.x - b.x, b.x * c.y - c.x * b.y};
+        // top-left fill rule: pixels exactly on an edge belong to the triangle only for left edges (and top edges for horizontal ones),
+        // so that a pixel on an edge shared by two triangles is drawn once; edge values are multiples of 1 / 256^2
+        bool top_left = tri.edge[i].x > 0 || (tri.edge[i].x == 0 && tri.edge[i].y < 0);
+        tri.bias[i] = top_left ? 0 : 1. / (256 * 256);
+    }
+    return VISIBLE;
+}
+
+double DepthEncoding::encode(const double z) const {
+    const double e = std::max(lo, std::min(hi, z * scale + offset));
+    if (rounding == FLOAT)
+        return static_cast<float>(e);
+    if (rounding == UNORM)
+        return std::nearbyint(e);
+    return e;
+}
+
+double DepthEncoding::decode(const double e) const {
+    return (e - offset) / scale;
+}
+
+// portable version, also the reference the vectorized ones are checked against by check_block_kernels
+static int block_scalar(const Triangle &tri, const vec3 &w, const DepthEncoding &enc, const double *const zrow[2], FragmentPacket &frag) {
+    int mask = 0;
+    for (int l = 0; l < packet_size; l++) {
+        const int dx = l % 4, dy = l / 4;
+        bool inside = true;
+        frag.depth[l] = 0;
+        for (int i = 3; i--; ) {
+            // edge values are exact, so stepping them in any order gives the same result
+            double e = w[i] + tri.edge[i].x * dx + tri.edge[i].y * dy;
+            inside = inside && e >= tri.bias[i];
+            frag.bar[i][l] = e * tri.inv_area;
+            frag.depth[l] += tri.depth[i] * frag.bar[i][l];
+        }
+        frag.zenc[l] = enc.encode(frag.depth[l]);
+        if (inside && !(frag.zenc[l] < zrow[dy][dx]))
+            mask |= 1 << l;
+        if constexpr (profiling)
+            mask |= inside << (l + packet_size);
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// DepthEncoding::encode on 2 lanes, unorm values are rounded to nearest even by adding and subtracting 2^52
+static __m128d encode_sse2(const DepthEncoding &enc, const __m128d z) {
+    __m128d e = _mm_add_pd(_mm_mul_pd(z, _mm_set1_pd(enc.scale)), _mm_set1_pd(enc.offset));
+    e = _mm_max_pd(_mm_min_pd(e, _mm_set1_pd(enc.hi)), _mm_set1_pd(enc.lo));
+    if (enc.rounding == DepthEncoding::FLOAT)
+        return _mm_cvtps_pd(_mm_cvtpd_ps(e));
+    if (enc.rounding == DepthEncoding::UNORM)
+        return _mm_sub_pd(_mm_add_pd(e, _mm_set1_pd(4503599627370496.)), _mm_set1_pd(4503599627370496.));
+    return e;
+}
+
+// 2 lanes per register, SSE2 is always there on x86-64
+static int block_sse2(const Triangle &tri, const vec3 &w, const DepthEncoding &enc, const double *const zrow[2], FragmentPacket &frag) {
+    int mask = 0;
+    for (int r = 0; r < 4; r++) {
+        const int dx = (r % 2) * 2, dy = r / 2;
+        const __m128d lane_x = _mm_set_pd(dx + 1, dx);
+        __m128d inside = _mm_castsi128_pd(_mm_set1_epi32(-1));
+        __m128d depth = _mm_setzero_pd();
+        for (int i = 3; i--; ) {
+            __m128d e = _mm_add_pd(_mm_set1_pd(w[i] + tri.edge[i].y * dy), _mm_mul_pd(_mm_set1_pd(tri.edge[i].x), lane_x));
+            inside = _mm_and_pd(inside, _mm_cmpge_pd(e, _mm_set1_pd(tri.bias[i])));
+            __m128d bc = _mm_mul_pd(e, _mm_set1_pd(tri.inv_area));
+            _mm_storeu_pd(frag.bar[i] + r * 2, bc);
+            depth = _mm_add_pd(depth, _mm_mul_pd(_mm_set1_pd(tri.depth[i]), bc));
+        }
+        _mm_storeu_pd(frag.depth + r * 2, depth);
+        __m128d zenc = encode_sse2(enc, depth);
+        _mm_storeu_pd(frag.zenc + r * 2, zenc);
+        __m128d pass = _mm_and_pd(inside, _mm_cmpnlt_pd(zenc, _mm_loadu_pd(zrow[dy] + dx)));
+        mask |= _mm_movemask_pd(pass) << (r * 2);
+        if constexpr (profiling)
+            mask |= _mm_movemask_pd(inside) << (r * 2 + packet_size);
+    }
+    return mask;
+}
+
+// DepthEncoding::encode on 4 lanes
+__attribute__((target("avx2"))) static __m256d encode_avx2(const DepthEncoding &enc, const __m256d z) {
+    __m256d e = _mm256_add_pd(_mm256_mul_pd(z, _mm256_set1_pd(enc.scale)), _mm256_set1_pd(enc.offset));
+    e = _mm256_max_pd(_mm256_min_pd(e, _mm256_set1_pd(enc.hi)), _mm256_set1_pd(enc.lo));
+    if (enc.rounding == DepthEncoding::FLOAT)
+        return _mm256_cvtps_pd(_mm256_cvtpd_ps(e));
+    if (enc.rounding == DepthEncoding::UNORM)
+        return _mm256_round_pd(e, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    return e;
+}
+
+// 4 lanes per register, one block row at a time
+__attribute__((target("avx2"))) static int block_avx2(const Triangle &tri, const vec3 &w, const DepthEncoding &enc, const double *const zrow[2], FragmentPacket &frag) {
+    const __m256d lane_x = _mm256_set_pd(3, 2, 1, 0);
+    int mask = 0;
+    for (int dy = 0; dy < 2; dy++) {
+        __m256d inside = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+        __m256d depth = _mm256_setzero_pd();
+        for (int i = 3; i--; ) {
+            __m256d e = _mm256_add_pd(_mm256_set1_pd(w[i] + tri.edge[i].y * dy), _mm256_mul_pd(_mm256_set1_pd(tri.edge[i].x), lane_x));
+            inside = _mm256_and_pd(inside, _mm256_cmp_pd(e, _mm256_set1_pd(tri.bias[i]), _CMP_GE_OQ));
+            __m256d bc = _mm256_mul_pd(e, _mm256_set1_pd(tri.inv_area));
+            _mm256_storeu_pd(frag.bar[i] + dy * 4, bc);
+            depth = _mm256_add_pd(depth, _mm256_mul_pd(_mm256_set1_pd(tri.depth[i]), bc));
+        }
+        _mm256_storeu_pd(frag.depth + dy * 4, depth);
+        __m256d zenc = encode_avx2(enc, depth);
+        _mm256_storeu_pd(frag.zenc + dy * 4, zenc);
+        __m256d pass = _mm256_and_pd(inside, _mm256_cmp_pd(zenc, _mm256_loadu_pd(zrow[dy]), _CMP_NLT_UQ));
+        mask |= _mm256_movemask_pd(pass) << (dy * 4);
+        if constexpr (profiling)
+            mask |= _mm256_movemask_pd(inside) << (dy * 4 + packet_size);
+    }
+    return mask;
+}
+#endif
+
+static BlockKernel select_block_kernel() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2"))
+        return block_avx2;
+    return block_sse2;
+#else
+    return block_scalar;
+#endif
+}
+
+BlockKernel block_kernel() {
+    static const BlockKernel kernel = select_block_kernel();
+    return kernel;
+}
+
+bool check_block_kernels() {
+    std::vector<std::pair<const char *, BlockKernel>> kernels;
+#if defined(__x86_64__) && defined(__GNUC__)
+    kernels.push_back({"sse2", block_sse2});
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({"avx2", block_avx2});
+#endif
+    const DepthEncoding encodings[] = {DepthBuffer<DepthF64>(8, 8).encoding, DepthBuffer<DepthF32>(8, 8).encoding,
+                                       DepthBuffer<DepthU24>(8, 8).encoding, DepthBuffer<DepthU16>(8, 8).encoding};
+    // triangles reaching out of a 64x64 screen and depths out of [-1, 1], so that clamping is checked too
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> coord(-16, 80), depth(-1.5, 1.5);
+    const int *pos = sample_positions(8);
+    for (const auto &[name, kernel] : kernels)
+        for (const DepthEncoding &enc : encodings)
+            for (int n = 0; n < 200; n++) {
+                vec4 pts[3];
+                for (vec4 &p : pts)
+                    p = {coord(rng), coord(rng), depth(rng), 1};
+                Triangle tri;
+                if (setup_triangle(pts, 0, 64, 64, tri) == BACKFACE)
+                    std::swap(pts[1], pts[2]);
+                if (setup_triangle(pts, 0, 64, 64, tri) != VISIBLE)
+                    continue;
+                for (int y = tri.bboxmin[1] & ~1; y <= tri.bboxmax[1]; y += 2)
+                    for (int x = tri.bboxmin[0] & ~3; x <= tri.bboxmax[0]; x += 4)
+                        // the pixel centers, then the samples of 8x multisampling
+                        for (int k = -1; k < 8; k++) {
+                            vec3 w;
+                            for (int i = 0; i < 3; i++)
+                                w[i] = tri.edge[i] * vec3{static_cast<double>(x), static_cast<double>(y), 1} +
+                                       (k < 0 ? 0 : (tri.edge[i].x * pos[k * 2] + tri.edge[i].y * pos[k * 2 + 1]) / 16);
+                            double z[2][4];
+                            for (int l = 0; l < packet_size; l++)
+                                z[l / 4][l % 4] = enc.encode(depth(rng));
+                            const double *zrow[2] = {z[0], z[1]};
+                            FragmentPacket reference, frag;
+                            const int mask = block_scalar(tri, w, enc, zrow, reference);
+                            if (kernel(tri, w, enc, zrow, frag) != mask || std::memcmp(frag.zenc, reference.zenc, sizeof(frag.zenc))) {
+                                std::cerr << "block kernel " << name << " differs from block_scalar at " << x << " " << y << std::endl;
+                                return false;
+                            }
+                        }
+            }
+    return true;
+}
+
+template<class Format> DepthBuffer<Format>::DepthBuffer(const int w, const int h, const double zmin, const double zmax, const int samples) :
+        width(w), height(h), samples(samples), cells_x((w + hiz_cell - 1) / hiz_cell), tiles_x((w + tile_size - 1) / tile_size) {
+    if (Format::bits) {
+        const double levels = (1u << Format::bits) - 1;
+        encoding = {DepthEncoding::UNORM, levels / (zmax - zmin), -zmin * levels / (zmax - zmin), 0, levels};
+    } else {
+        constexpr double max = std::numeric_limits<type>::max();
+        encoding = {sizeof(type) < sizeof(double) ? DepthEncoding::FLOAT : DepthEncoding::NONE, 1, 0, -max, max};
+    }
+    z.resize(static_cast<std::size_t>(w) * h * samples);
+    cell_min.resize(cells_x * ((h + hiz_cell - 1) / hiz_cell));
+    cell_max.resize(cell_min.size());
+    tile_min.resize(tiles_x * ((h + tile_size - 1) / tile_size));
+    tile_max.resize(tile_min.size());
+    clear();
+}
+
+// reset every depth to the farthest value
+template<class Format> void DepthBuffer<Format>::clear() {
+    std::fill(z.begin(), z.end(), static_cast<type>(encoding.lo));
+    std::fill(cell_min.begin(), cell_min.end(), encoding.lo);
+    std::fill(cell_max.begin(), cell_max.end(), encoding.lo);
+    std::fill(tile_min.begin(), tile_min.end(), encoding.lo);
+    std::fill(tile_max.begin(), tile_max.end(), encoding.lo);
+}
+
+ColorBuffer::ColorBuffer(const int w, const int h, const int samples) : width(w), height(h), samples(samples), pixels(static_cast<std::size_t>(w) * h * samples) {}
+
+TGAColor ColorBuffer::get(const int x, const int y) const {
+    TGAColor ret;
+    std::memcpy(ret.bgra, &pixels[x + static_cast<std::size_t>(y) * width], 4);
+    return ret;
+}
+
+void ColorBuffer::clear(const TGAColor &c) {
+    std::uint32_t packed;
+    std::memcpy(&packed, c.bgra, 4);
+    std::fill(pixels.begin(), pixels.end(), packed);
+}
+
+void ColorBuffer::resolve(ColorBuffer &out) const {
+    ProfileScope scope("resolve");
+    const std::size_t plane = static_cast<std::size_t>(width) * height;
+    #pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const std::size_t i = x + static_cast<std::size_t>(y) * width;
+            int sum[4] = {0, 0, 0, 0};
+            for (int k = 0; k < samples; k++) {
+                std::uint8_t bgra[4];
+                std::memcpy(bgra, &pixels[i + k * plane], 4);
+                for (int c = 0; c < 4; c++)
+                    sum[c] += bgra[c];
+            }
+            std::uint8_t bgra[4];
+            for (int c = 0; c < 4; c++)
+                bgra[c] = (sum[c] + samples / 2) / samples;
+            std::memcpy(&out.pixels[i], bgra, 4);
         }
     }
+}
 
+TGAImage ColorBuffer::image(const int bpp) const {
+    TGAImage ret(width, height, bpp);
+    std::uint8_t *out = ret.buffer();
     #pragma omp parallel for
-    // iterate over each pixel in the bounding box
-    for (int x = std::max(0, bboxmin[0]); x <= std::min(bboxmax[0], image.width() - 1); x++) {
-        for (int y = std::max(0, bboxmin[1]); y <= std::min(bboxmax[1], image.height() - 1); y++) {
-            // barycentric coordinates of the pixel
-            vec3 bc = barycentric(pts_xy, {static_cast<double>(x), static_cast<double>(y)});
-            // interpolated depth of the pixel
-            double frag_depth = vec3{pts[0][2] / pts[0][3], pts[1][2] / pts[1][3], pts[2][2] / pts[2][3]} * bc;
-            // if the pixel is not inside the triangle (either of the barycentric coordinates is negative), or the depth is smaller than the zbuffer, then skip
-            if (bc.x < 0 || bc.y < 0 || bc.z < 0 || frag_depth < zbuffer[x + y * image.width()])
-                continue;
-                
-            TGAColor color;
-            // fragment shader can discard the pixel
-            if (shader.fragment(bc, color))
-                continue;
-            // update zbuffer with current depth
-            zbuffer[x + y * image.width()] = frag_depth;
-            image.set(x, y, color);
+    for (std::size_t i = 0; i < static_cast<std::size_t>(width) * height; i++) {
+        std::uint8_t bgra[4];
+        std::memcpy(bgra, &pixels[i], 4);
+        std::memcpy(out + i * bpp, bgra, bpp);
+    }
+    return ret;
+}
+
+bool ColorBuffer::write_tga_file(const std::string filename, const int bpp) const {
+    TGAWriter out(filename, width, height, bpp);
+    const bool ok = out.good() && write_tga_rows(out, height, bpp);
+    return out.close() && ok;
+}
+
+bool ColorBuffer::write_tga_rows(TGAWriter &out, const int nrows, const int bpp) const {
+    ProfileScope scope("encode");
+    bool ok = true;
+    // bands are packed to the bytes per pixel of the file and encoded in parallel, then written in order
+    #pragma omp parallel for ordered schedule(dynamic, 1)
+    for (int y = 0; y < nrows; y += tga_band) {
+        const int n = std::min(tga_band, nrows - y);
+        std::vector<std::uint8_t> rows(width * n * bpp);
+        for (int i = 0; i < width * n; i++)
+            std::memcpy(&rows[i * bpp], &pixels[static_cast<std::size_t>(y) * width + i], bpp);
+        const std::vector<std::uint8_t> band = out.encode(rows.data(), n);
+        #pragma omp ordered
+        ok = ok && out.write(band, n);
+    }
+    return ok;
+}
+
+DrawStats &DrawStats::operator+=(const DrawStats &s) {
+    faces += s.faces;
+    outside += s.outside;
+    backface += s.backface;
+    degenerate += s.degenerate;
+    clipped += s.clipped;
+    triangles += s.triangles;
+    fragments += s.fragments;
+    vertex_ms += s.vertex_ms;
+    setup_ms += s.setup_ms;
+    raster_ms += s.raster_ms;
+    return *this;
+}
+
+std::ostream &operator<<(std::ostream &out, const DrawStats &s) {
+    return out << s.faces << " faces, culled " << s.outside << " outside, " << s.backface << " back-facing, " << s.degenerate << " degenerate, "
+               << s.clipped << " clipped, " << s.triangles << " triangles rasterized, " << s.fragments << " fragments";
+}
+
+void clip_volume(const int width, const int height, const double margin, ClipPlane planes[9]) {
+    planes[0] = {{ 1, 0, 0, margin}, 0};
+    planes[1] = {{-1, 0, 0, width - 1. + margin}, 0};
+    planes[2] = {{0,  1, 0, margin}, 0};
+    planes[3] = {{0, -1, 0, height - 1. + margin}, 0};
+    planes[4] = {{0, 0, 0, 1}, -near_w};
+    planes[5] = {{ 1, 0, 0, guard_band}, 0};
+    planes[6] = {{-1, 0, 0, width - 1. + guard_band}, 0};
+    planes[7] = {{0,  1, 0, guard_band}, 0};
+    planes[8] = {{0, -1, 0, height - 1. + guard_band}, 0};
+}
+
+// clip a face to the near plane and the guard band (Sutherland-Hodgman), then set up the fan of the clipped polygon; the pieces are appended to tris
+Cull clip_triangle(const vec4 pts[3], const int code, const int iface, const ClipPlane planes[9], const int width, const int height, const double margin,
+                   std::vector<Triangle> &tris) {
+    // the sign of the determinant of the homogeneous x, y, w is the orientation of the face, even when it crosses the near plane
+    const double orientation = mat<3, 3>{{{pts[0][0], pts[1][0], pts[2][0]}, {pts[0][1], pts[1][1], pts[2][1]}, {pts[0][3], pts[1][3], pts[2][3]}}}.det();
+    if (orientation < 0)
+        return BACKFACE;
+    if (!(orientation > 0))
+        return DEGENERATE;
+
+    // polygon vertices and their weights in the face, each plane adds at most one vertex
+    vec4 poly[9], clipped[9];
+    vec3 weight[9], clipped_weight[9];
+    int n = 3;
+    for (int i = 0; i < 3; i++) {
+        poly[i] = pts[i];
+        weight[i] = {};
+        weight[i][i] = 1;
+    }
+    for (int p = 0; p < 9 && n; p++) {
+        if (!(code >> p & clip_planes >> p & 1))
+            continue;
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            const int j = (i + 1) % n;
+            const double di = planes[p].n * poly[i] + planes[p].d;
+            const double dj = planes[p].n * poly[j] + planes[p].d;
+            if (di >= 0) {
+                clipped[m] = poly[i];
+                clipped_weight[m++] = weight[i];
+            }
+            if ((di >= 0) != (dj >= 0)) {
+                const double t = di / (di - dj);
+                clipped[m] = poly[i] + (poly[j] - poly[i]) * t;
+                clipped_weight[m++] = weight[i] + (weight[j] - weight[i]) * t;
+            }
         }
+        n = m;
+        std::copy(clipped, clipped + n, poly);
+        std::copy(clipped_weight, clipped_weight + n, weight);
     }
-}
\ No newline at end of file
+
+    // barycentric coordinates of the polygon vertices in the face: in front of the camera the screen space ones, so that
+    // the pieces interpolate exactly like the whole face would, across the near plane the clip space weights
+    vec3 bar[9];
+    for (int i = 0; i < n; i++) {
+        bar[i] = weight[i];
+        if (code & 1 << 4)
+            continue;
+        for (int k = 0; k < 3; k++)
+            bar[i][k] *= pts[k][3];
+        bar[i] = bar[i] / (bar[i][0] + bar[i][1] + bar[i][2]);
+    }
+
+    Cull result = OUTSIDE;
+    for (int i = 1; i + 1 < n; i++) {
+        const vec4 piece[3] = {poly[0], poly[i], poly[i + 1]};
+        Triangle tri;
+        if (setup_triangle(piece, iface, width, height, tri, margin) != VISIBLE)
+            continue;
+        tri.clipped = true;
+        tri.bar_map.set_col(0, bar[0]);
+        tri.bar_map.set_col(1, bar[i]);
+        tri.bar_map.set_col(2, bar[i + 1]);
+        tris.push_back(tri);
+        result = VISIBLE;
+    }
+    return result;
+}
+
+GBuffer::GBuffer(const int w, const int h) : width(w), height(h), id(static_cast<std::size_t>(w) * h, -1) {}
+
+void GBuffer::clear() {
+    std::fill(id.begin(), id.end(), -1);
+    tris.clear();
+    shaders.clear();
+    fragments = shaded = 0;
+}
+
+// deferred shading pass: every covered pixel of the G-buffer is shaded exactly once, block by block so that shaders get whole packets
+void shade(GBuffer &gbuffer, ColorBuffer &image) {
+    const int width = gbuffer.width, height = gbuffer.height;
+    long long shaded = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:shaded)
+    for (int row = 0; row < height; row += 2) {
+        ProfileScope scope("shade");
+        const long long before = shaded;
+        FragmentPacket frag;
+        frag.y = row;
+        for (frag.x = 0; frag.x < width; frag.x += 4) {
+            int ids[packet_size];
+            for (int l = 0; l < packet_size; l++) {
+                const int x = frag.x + l % 4, y = frag.y + l / 4;
+                ids[l] = x < width && y < height ? gbuffer.id[x + static_cast<std::size_t>(y) * width] : -1;
+            }
+            // one packet per distinct triangle of the block
+            for (int first = 0; first < packet_size; first++) {
+                const int id = ids[first];
+                if (id < 0)
+                    continue;
+                int mask = 0;
+                for (int l = first; l < packet_size; l++) {
+                    if (ids[l] != id)
+                        continue;
+                    mask |= 1 << l;
+                    ids[l] = -1;
+                }
+                // barycentric coordinates of all the lanes, the edge values are exact so they match the visibility pass
+                const Triangle &tri = gbuffer.tris[id];
+                for (int l = 0; l < packet_size; l++) {
+                    const vec3 p = {static_cast<double>(frag.x + l % 4), static_cast<double>(frag.y + l / 4), 1};
+                    frag.depth[l] = 0;
+                    for (int i = 3; i--; ) {
+                        frag.bar[i][l] = (tri.edge[i] * p) * tri.inv_area;
+                        frag.depth[l] += tri.depth[i] * frag.bar[i][l];
+                    }
+                }
+                face_bar(tri, frag);
+                TGAColor color[packet_size];
+                gbuffer.shaders[id]->fragment_packet(tri.iface, frag, mask, color);
+                for (int l = 0; mask; l++, mask >>= 1) {
+                    if (!(mask & 1))
+                        continue;
+                    image.set(frag.x + l % 4, frag.y + l / 4, color[l]);
+                    shaded++;
+                }
+            }
+        }
+        profile_count(PIXELS_SHADED, shaded - before);
+    }
+    gbuffer.shaded += shaded;
+}
+
+// depth formats the rasterizer is built for
+template struct DepthBuffer<DepthF64>;
+template struct DepthBuffer<DepthF32>;
+template struct DepthBuffer<DepthU24>;
+template struct DepthBuffer<DepthU16>;
+template long long triangle(const Triangle &, const IShader &, const int, const int, const int, const int, ColorBuffer &, DepthBuffer<DepthF64> &);
+template long long triangle(const Triangle &, const IShader &, const int, const int, const int, const int, ColorBuffer &, DepthBuffer<DepthF32> &);
+template long long triangle(const Triangle &, const IShader &, const int, const int, const int, const int, ColorBuffer &, DepthBuffer<DepthU24> &);
+template long long triangle(const Triangle &, const IShader &, const int, const int, const int, const int, ColorBuffer &, DepthBuffer<DepthU16> &);
+template DrawStats draw(const int, std::span<const int>, IShader &, ColorBuffer &, DepthBuffer<DepthF64> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, ColorBuffer &, DepthBuffer<DepthF32> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, ColorBuffer &, DepthBuffer<DepthU24> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, ColorBuffer &, DepthBuffer<DepthU16> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, GBuffer &, DepthBuffer<DepthF64> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, GBuffer &, DepthBuffer<DepthF32> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, GBuffer &, DepthBuffer<DepthU24> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, GBuffer &, DepthBuffer<DepthU16> &, const std::vector<int> *);
+template long long triangle(const Triangle &, const int, const int, const int, const int, DepthBuffer<DepthF64> &);
+template long long triangle(const Triangle &, const int, const int, const int, const int, DepthBuffer<DepthF32> &);
+template long long triangle(const Triangle &, const int, const int, const int, const int, DepthBuffer<DepthU24> &);
+template long long triangle(const Triangle &, const int, const int, const int, const int, DepthBuffer<DepthU16> &);
+template DrawStats draw(const int, std::span<const int>, IShader &, DepthBuffer<DepthF64> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, DepthBuffer<DepthF32> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, DepthBuffer<DepthU24> &, const std::vector<int> *);
+template DrawStats draw(const int, std::span<const int>, IShader &, DepthBuffer<DepthU16> &, const std::vector<int> *);
+
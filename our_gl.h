@@ -1,21 +1,206 @@
+#pragma once
+#include <concepts>
+#include <cstring>
+#include <span>
 #include "tgaimage.h"
 #include "geometry.h"
+#include "texture.h"
+
+// side length in pixels of the square screen tiles that triangles are binned into
+constexpr int tile_size = 32;
+// number of pixels rasterized at once, a block of 4x2 pixels
+constexpr int packet_size = 8;
+// side length in pixels of the cells of the hierarchical depth buffer
+constexpr int hiz_cell = 8;
+static_assert(tile_size % hiz_cell == 0 && hiz_cell % 4 == 0, "tiles must be made of whole cells, cells of whole blocks");
+static_assert((tile_size / hiz_cell) * (tile_size / hiz_cell) <= 32, "cells of a tile are tracked in a 32-bit mask");
+// triangles are clipped to the near plane w = near_w and to a band of guard_band pixels around the screen,
+// inside of it snapped coordinates stay small enough for the edge functions to be exact
+constexpr double near_w = 1e-3;
+constexpr double guard_band = 8192;
+
+// model + view, projection, viewport matrices of the calling thread
+extern thread_local mat<4, 4> ModelView;
+extern thread_local mat<4, 4> Projection;
+extern thread_local mat<4, 4> Viewport;
 
 // model + view, projection, viewport transform
 void lookat(const vec3 eye, const vec3 center, const vec3 up);
 void projection(const double coeff=0);
 void viewport(const int x, const int y, const int w, const int h);
 
+// fragments of one block of pixels in structure-of-arrays layout, lane l is the pixel (x + l % 4, y + l / 4)
+struct FragmentPacket {
+    int x, y;                          // pixel of lane 0
+    double bar[3][packet_size];        // barycentric coordinates
+    double depth[packet_size];         // interpolated screen space depth
+    double zenc[packet_size];          // depth encoded for the depth buffer
+};
+
+// screen space derivatives of a varying interpolated in the lanes of a packet, taken per 2x2 quad (lanes 0 1 4 5 and 2 3 6 7)
+// and shared by the four lanes of the quad; the lanes outside of the triangle carry the interpolated values too, so they are always defined
+inline void quad_derivatives(const double f[packet_size], double dfdx[packet_size], double dfdy[packet_size]) {
+    for (int q = 0; q < 4; q += 2) {
+        const double dx = f[q + 1] - f[q], dy = f[q + 4] - f[q];
+        for (const int l : {q, q + 1, q + 4, q + 5}) {
+            dfdx[l] = dx;
+            dfdy[l] = dy;
+        }
+    }
+}
+
 struct IShader {
     // get color from texture image
     static TGAColor sample2D(const TGAImage &img, vec2 &uvf) {
         return img.get(uvf[0] * img.width(), uvf[1] * img.height());
     }
-    // set up for one vertex (texture coordinate, normal vector, transformed coordinate)
-    virtual void vertex(const int iface, const int nthvert, vec4 &gl_Position) = 0;
-    // shade for one fragment (pixel) inside triangle
-    virtual bool fragment(const vec3 bar, TGAColor &color) = 0;
+    static TGAColor sample2D(const Texture &tex, vec2 &uvf) {
+        return tex.nearest(uvf[0], uvf[1]);
+    }
+    // set up for one vertex of the vertex buffer (texture coordinate, normal vector, transformed coordinate), varyings are stored per vertex
+    // and gathered by the fragment shader through the indices of the face; called once per vertex, concurrently
+    virtual void vertex(const int ivert, vec4 &gl_Position) = 0;
+    // shade for one fragment (pixel) inside triangle iface, called concurrently by the tile workers
+    virtual bool fragment(const int iface, const vec3 bar, TGAColor &color) const = 0;
+    // shade the lanes of a block that are set in mask, clearing the ones that are discarded; by default fragment() is called lane by lane,
+    // shaders override it to work on the whole packet in structure-of-arrays form
+    virtual void fragment_packet(const int iface, const FragmentPacket &frag, int &mask, TGAColor color[packet_size]) const;
+};
+
+// what the draw calls need of a shader, the pipeline is instantiated per shader type from pipeline.h: the stages of a type that is not
+// polymorphic, or of a final class, are bound at compile time and inlined into the vertex and raster loops, IShader itself goes through its
+// virtual functions and is built once by our_gl.cpp
+template<class S> concept VertexShader = requires(S &shader, const int i, vec4 &position) {
+    shader.vertex(i, position);
+};
+template<class S> concept FragmentShader = VertexShader<S> && requires(const S &shader, const int i, const FragmentPacket &frag, int &mask, TGAColor *color) {
+    shader.fragment_packet(i, frag, mask, color);
+};
+
+// triangle set up for rasterization, shared by all the tiles it overlaps
+struct Triangle {
+    int iface;                         // face the fragments are shaded for
+    int bboxmin[2], bboxmax[2];        // pixel bounding box, clamped to the screen
+    vec3 edge[3];                      // edge equations a * x + b * y + c, the i-th one is the unnormalized barycentric coordinate of vertex i
+    double bias[3];                    // minimal edge values of a covered pixel (top-left fill rule)
+    double inv_area;                   // 1 / (twice the area of the triangle)
+    vec3 depth;                        // screen space depth of the vertices
+    double zmax;                       // closest depth of the triangle
+    bool clipped;                      // part of a clipped face, its barycentric coordinates are mapped to the ones of the face
+    mat<3, 3> bar_map;                 // column i is the barycentric coordinate in the face of vertex i
+};
+
+// outcome of triangle setup, only VISIBLE triangles are rasterized
+enum Cull { VISIBLE, OUTSIDE, BACKFACE, DEGENERATE };
+
+// primitive assembly counters of draw calls
+struct DrawStats {
+    long long faces = 0;               // faces submitted
+    long long outside = 0;             // culled against the frustum, or covering no pixel center
+    long long backface = 0;            // culled as clockwise on screen
+    long long degenerate = 0;          // culled as zero area (less than 1e-3 pixel)
+    long long clipped = 0;             // faces crossing the near plane or the guard band, clipped into smaller triangles
+    long long triangles = 0;           // triangles sent to the rasterizer
+    long long fragments = 0;           // fragments written, or that passed the depth test in a visibility pass
+    double vertex_ms = 0;              // wall time of the vertex stage
+    double setup_ms = 0;               // of primitive assembly, clipping and binning
+    double raster_ms = 0;              // of rasterization, including the fragment shader of forward draws
+    DrawStats &operator+=(const DrawStats &s);
 };
+std::ostream &operator<<(std::ostream &out, const DrawStats &s);
+
+// depth buffer storage formats, bits is the precision of unsigned normalized ones and 0 for floating point ones
+struct DepthF64 { typedef double        type; static constexpr int bits = 0;  };
+struct DepthF32 { typedef float         type; static constexpr int bits = 0;  };
+struct DepthU24 { typedef std::uint32_t type; static constexpr int bits = 24; }; // in a 32-bit word, the top byte is unused
+struct DepthU16 { typedef std::uint16_t type; static constexpr int bits = 16; };
+
+// how screen depth is turned into stored values: clamp(z * scale + offset, lo, hi), then rounded to the storage precision;
+// the depth test compares encoded values, so fragments that land on the same stored value tie
+struct DepthEncoding {
+    enum Rounding { NONE, FLOAT, UNORM } rounding;
+    double scale, offset, lo, hi;
+    double encode(const double z) const;
+    double decode(const double e) const;
+};
+
+// depth buffer with a hierarchy of per-cell and per-tile min/max depth, larger depth is closer;
+// whole tiles and cells farther than what is already drawn are rejected before any per pixel work.
+// Multisampled (4 or 8 samples) each sample has a plane of the size of the screen, the hierarchy covers all the samples
+template<class Format=DepthF64> struct DepthBuffer {
+    typedef typename Format::type type;
+    int width, height;
+    int samples;                         // per pixel, 1, 4 or 8
+    int cells_x, tiles_x;                // number of cells and tiles per row
+    DepthEncoding encoding;
+    std::vector<type> z;                 // per sample encoded depth, sample k of pixel (x, y) at x + y * width + k * width * height
+    std::vector<double> cell_min, cell_max;
+    std::vector<double> tile_min, tile_max;
+    // unsigned normalized formats map the screen depth range [zmin, zmax] to [0, 1], floating point ones store it as is
+    DepthBuffer(const int w, const int h, const double zmin=-1, const double zmax=1, const int samples=1);
+    void clear();
+    // depth of the first sample
+    double get(const int x, const int y) const { return encoding.decode(z[x + static_cast<std::size_t>(y) * width]); }
+};
+
+// color target, one packed 32-bit BGRA word per pixel so that a pixel is written with a single store
+struct ColorBuffer {
+    int width, height;
+    int samples;                         // per pixel, in planes as in DepthBuffer
+    std::vector<std::uint32_t> pixels;
+    ColorBuffer(const int w, const int h, const int samples=1);
+    void set(const int x, const int y, const TGAColor &c) { std::memcpy(&pixels[x + static_cast<std::size_t>(y) * width], c.bgra, 4); }
+    void set(const int x, const int y, const int k, const TGAColor &c) { std::memcpy(&pixels[x + static_cast<std::size_t>(y) * width + static_cast<std::size_t>(k) * width * height], c.bgra, 4); }
+    TGAColor get(const int x, const int y) const;
+    void clear(const TGAColor &c={});
+    // average of the samples of each pixel into a single sampled buffer of the same size
+    void resolve(ColorBuffer &out) const;
+    // copy to an image for output, the first sample of multisampled buffers
+    TGAImage image(const int bpp=TGAImage::RGB) const;
+    // write straight to a tga file band by band, without the copy to an image
+    bool write_tga_file(const std::string filename, const int bpp=TGAImage::RGB) const;
+    // append the first nrows scanlines to a file of the same width and bytes per pixel, for images rendered in strips
+    bool write_tga_rows(TGAWriter &out, const int nrows, const int bpp=TGAImage::RGB) const;
+};
+
+// set up triangle from its screen space vertices, which must be in front of the camera and inside the guard band; the bounding box covers
+// the pixels whose center is within margin of the triangle, half a pixel for multisampling
+Cull setup_triangle(const vec4 pts[3], const int iface, const int width, const int height, Triangle &tri, const double margin=0);
+
+// draw triangle, only the pixels inside the tile [x0, x1) x [y0, y1) are touched, returns the number of pixels written; with multisampled
+// buffers (of the same sample count) the shader runs once per pixel and its color goes to the samples that are covered and pass the depth test
+template<class Format, FragmentShader S> long long triangle(const Triangle &tri, const S &shader, const int x0, const int y0, const int x1, const int y1, ColorBuffer &image, DepthBuffer<Format> &zbuffer);
+
+// depth only version: no fragment shader and no color target, returns the number of depth values written
+template<class Format> long long triangle(const Triangle &tri, const int x0, const int y0, const int x1, const int y1, DepthBuffer<Format> &zbuffer);
+
+// draw an indexed triangle list, three indices per face into a buffer of nverts vertices: run the vertex shader once per vertex,
+// assemble and bin the triangles into screen tiles, then rasterize the tiles in parallel; with a list of face ids only those faces
+// and their vertices are processed, in the order of the list
+template<class Format, FragmentShader S> DrawStats draw(const int nverts, std::span<const int> indices, S &shader, ColorBuffer &image, DepthBuffer<Format> &zbuffer,
+                                                        const std::vector<int> *faces=nullptr);
+
+// depth only pass of an indexed triangle list, e.g. into a shadow map: only the vertex shader runs
+template<class Format, VertexShader S> DrawStats draw(const int nverts, std::span<const int> indices, S &shader, DepthBuffer<Format> &zbuffer,
+                                                      const std::vector<int> *faces=nullptr);
+
+// visibility buffer for deferred shading: the triangle on top of each pixel, the fragments are shaded in a second pass
+struct GBuffer {
+    int width, height;
+    std::vector<int> id;                 // per pixel index of the visible triangle in tris, -1 if none
+    std::vector<Triangle> tris;          // triangles of all the draw calls since the last clear
+    std::vector<const IShader*> shaders; // shader of each triangle
+    long long fragments = 0;             // fragments that passed the depth test, i.e. the ones forward shading would have shaded
+    long long shaded = 0;                // fragments shaded by the deferred pass
+    GBuffer(const int w, const int h);
+    // forget the triangles and counters of the previous frame
+    void clear();
+};
+
+// visibility pass of an indexed triangle list: depth test only, the shader must outlive the shading pass, which calls it through IShader;
+// the depth buffer is single sampled
+template<class Format, class S> requires std::derived_from<S, IShader> DrawStats draw(const int nverts, std::span<const int> indices, S &shader, GBuffer &gbuffer,
+                                                                                     DepthBuffer<Format> &zbuffer, const std::vector<int> *faces=nullptr);
 
-// draw triangle
-void triangle(const vec4 clip_verts[3], IShader &shader, TGAImage &image, std::vector<double> &zbuffer);
\ No newline at end of file
+// deferred shading pass: shade each covered pixel of the G-buffer exactly once
+void shade(GBuffer &gbuffer, ColorBuffer &image);
@@ -0,0 +1,512 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include "our_gl.h"
+#include "profile.h"
+
+// the templated stages of the pipeline declared in our_gl.h, from the vertex stage to the depth test and the fragment shader: a shader
+// type includes them so that the draw calls are instantiated for it with its stages inlined, our_gl.cpp builds the IShader versions once
+
+// coverage, interpolated depth and depth test of one block of pixels, w holds the edge values at the pixel of lane 0
+// and zrow the depth buffer rows of the block (encoded, as doubles), returns the mask of the lanes that are covered and pass the test;
+// when profiling, the mask of the covered lanes follows in the next packet_size bits
+typedef int (*BlockKernel)(const Triangle &tri, const vec3 &w, const DepthEncoding &enc, const double *const zrow[2], FragmentPacket &frag);
+// the widest kernel the cpu supports, picked on the first call
+BlockKernel block_kernel();
+// runs the vectorized kernels the cpu supports and block_scalar on random blocks of every depth format, false and a message on std::cerr
+// when a mask or an encoded depth differs
+bool check_block_kernels();
+
+// plane of the clip volume in screen space homogeneous coordinates, P is inside when n * P + d >= 0
+struct ClipPlane {
+    vec4 n;
+    double d;
+};
+
+// the four sides of the screen (through the outermost pixel centers, or margin beyond them) and the near plane reject triangles that are
+// entirely outside of one of them, the near plane and the guard band sides are the ones triangles are clipped to
+constexpr int frustum_planes = 0x1f;
+constexpr int clip_planes = 0x1f0;
+void clip_volume(const int width, const int height, const double margin, ClipPlane planes[9]);
+// clip a face to the near plane and the guard band, the pieces are appended to tris
+Cull clip_triangle(const vec4 pts[3], const int code, const int iface, const ClipPlane planes[9], const int width, const int height, const double margin,
+                   std::vector<Triangle> &tris);
+
+// bit i is set when p is outside of plane i
+inline int outcode(const vec4 &p, const ClipPlane planes[9]) {
+    int code = 0;
+    for (int i = 0; i < 9; i++)
+        if (planes[i].n * p + planes[i].d < 0)
+            code |= 1 << i;
+    return code;
+}
+
+// milliseconds since start
+inline double elapsed_ms(const std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// sample positions of the multisampled buffers in 1/16 pixel from the pixel center, x then y: the standard 4x and 8x patterns
+inline const int *sample_positions(const int samples) {
+    static const int x4[4 * 2] = {-2, -6, 6, -2, -6, 2, 2, 6};
+    static const int x8[8 * 2] = {1, -3, -1, 3, 5, 1, -3, -5, -5, 5, -7, -1, 3, 7, 7, -7};
+    return samples == 8 ? x8 : x4;
+}
+
+// walk the blocks of the triangle inside the tile [x0, x1) x [y0, y1), visit(frag, mask, cover) gets the lanes that pass coverage and depth test
+// and returns the ones to write to the depth buffer; the hierarchy of the tile is kept up to date. Multisampled, a lane passes when one of its
+// samples does, cover holds the samples that pass per lane and frag the pixel centers for the shader; single sampled, cover is null
+template<bool multisample, class Format, typename Visit> void for_each_block(const Triangle &tri, const int x0, const int y0, const int x1, const int y1, DepthBuffer<Format> &depth, Visit visit) {
+    typedef typename Format::type type;
+    const BlockKernel kernel = block_kernel();
+    const int width = depth.width;
+    const int samples = multisample ? depth.samples : 1;
+    const std::size_t plane = static_cast<std::size_t>(width) * depth.height;
+    // the whole tile is rejected when its farthest depth is closer than the triangle, the hierarchy holds encoded values
+    const int tile = x0 / tile_size + y0 / tile_size * depth.tiles_x;
+    const double zmax = depth.encoding.encode(tri.zmax);
+    if (zmax < depth.tile_min[tile])
+        return;
+    // blocks are aligned to the screen, the rectangle is aligned to tiles and therefore to blocks
+    const int xmin = std::max(x0, tri.bboxmin[0]) & ~3, xmax = std::min(x1 - 1, tri.bboxmax[0]);
+    const int ymin = std::max(y0, tri.bboxmin[1]) & ~1, ymax = std::min(y1 - 1, tri.bboxmax[1]);
+    if (xmin > xmax || ymin > ymax)
+        return;
+
+    // edge values at the first block of the first row, then stepped by the edge coefficients
+    vec3 row = {tri.edge[0] * vec3{static_cast<double>(xmin), static_cast<double>(ymin), 1},
+                tri.edge[1] * vec3{static_cast<double>(xmin), static_cast<double>(ymin), 1},
+                tri.edge[2] * vec3{static_cast<double>(xmin), static_cast<double>(ymin), 1}};
+    const vec3 step_x = vec3{tri.edge[0].x, tri.edge[1].x, tri.edge[2].x} * 4;
+    const vec3 step_y = vec3{tri.edge[0].y, tri.edge[1].y, tri.edge[2].y} * 2;
+    // edge values of the samples relative to the pixel center, exact since the positions are multiples of 1/16
+    vec3 offset[8];
+    if constexpr (multisample) {
+        const int *pos = sample_positions(samples);
+        for (int k = 0; k < samples; k++)
+            for (int i = 0; i < 3; i++)
+                offset[k][i] = (tri.edge[i].x * pos[k * 2] + tri.edge[i].y * pos[k * 2 + 1]) / 16;
+    }
+
+    // cells of the tile whose minimum may have been overwritten, one bit per cell
+    std::uint32_t dirty = 0;
+    bool written = false;
+    long long tested = 0, rejected = 0;
+    FragmentPacket frag;
+    for (frag.y = ymin; frag.y <= ymax; frag.y += 2, row = row + step_y) {
+        vec3 w = row;
+        for (frag.x = xmin; frag.x <= xmax; frag.x += 4, w = w + step_x) {
+            // a block lies in a single cell, skip it when the cell is closer than the triangle
+            const int cell = frag.x / hiz_cell + frag.y / hiz_cell * depth.cells_x;
+            if (zmax < depth.cell_min[cell])
+                continue;
+            // the second row of a block on the last row of the screen does not exist, its lanes are outside of the tile
+            type *zrow[2] = {depth.z.data() + frag.x + static_cast<std::size_t>(frag.y) * width,
+                             frag.y + 1 < y1 ? depth.z.data() + frag.x + static_cast<std::size_t>(frag.y + 1) * width : nullptr};
+            const double *zread[2];
+            int lanes = (1 << packet_size) - 1;
+            // the kernels read doubles, other formats and blocks sticking out of the tile (at the right or bottom of the screen)
+            // go through a converted and padded copy of the zbuffer
+            double zcopy[2][4];
+            const bool padded = !std::is_same<type, double>::value || frag.x + 4 > x1 || frag.y + 2 > y1;
+            auto read = [&](const std::size_t s) {
+                if constexpr (std::is_same<type, double>::value) {
+                    if (!padded) {
+                        zread[0] = zrow[0] + s * plane;
+                        zread[1] = zrow[1] + s * plane;
+                    }
+                }
+                if (padded) {
+                    for (int l = 0; l < packet_size; l++) {
+                        const bool in = frag.x + l % 4 < x1 && frag.y + l / 4 < y1;
+                        zcopy[l / 4][l % 4] = in ? static_cast<double>(zrow[l / 4][l % 4 + s * plane]) : std::numeric_limits<double>::max();
+                        lanes &= ~(!in << l);
+                    }
+                    zread[0] = zcopy[0];
+                    zread[1] = zcopy[1];
+                }
+            };
+            int mask = 0, cover[packet_size];
+            double zenc[8][packet_size];
+            if constexpr (!multisample) {
+                read(0);
+                const int result = kernel(tri, w, depth.encoding, zread, frag);
+                mask = result & lanes;
+                if constexpr (profiling) {
+                    const int covered = result >> packet_size & lanes;
+                    tested += std::popcount(static_cast<unsigned>(covered));
+                    rejected += std::popcount(static_cast<unsigned>(covered & ~mask));
+                }
+                if (!mask)
+                    continue;
+                mask = visit(frag, mask, static_cast<const int *>(nullptr));
+            } else {
+                // coverage and depth test sample by sample, each one against its own plane of the depth buffer
+                int covered = 0;
+                std::fill(cover, cover + packet_size, 0);
+                for (int k = 0; k < samples; k++) {
+                    read(k);
+                    const int result = kernel(tri, w + offset[k], depth.encoding, zread, frag);
+                    const int pass = result & lanes;
+                    for (int l = 0; l < packet_size; l++)
+                        cover[l] |= (pass >> l & 1) << k;
+                    mask |= pass;
+                    covered |= result >> packet_size & lanes;
+                    std::copy(frag.zenc, frag.zenc + packet_size, zenc[k]);
+                }
+                if constexpr (profiling) {
+                    tested += std::popcount(static_cast<unsigned>(covered));
+                    rejected += std::popcount(static_cast<unsigned>(covered & ~mask));
+                }
+                if (!mask)
+                    continue;
+                // the shader runs once per pixel, at its center
+                kernel(tri, w, depth.encoding, zread, frag);
+                mask = visit(frag, mask, cover);
+            }
+
+            // update zbuffer with current depth, depth only grows so the maximum of the cell follows and the minimum has to be recomputed
+            // only if it was overwritten
+            for (int l = 0; mask; l++, mask >>= 1) {
+                if (!(mask & 1))
+                    continue;
+                for (int k = 0; k < samples; k++) {
+                    if (multisample && !(cover[l] >> k & 1))
+                        continue;
+                    const double e = multisample ? zenc[k][l] : frag.zenc[l];
+                    type &z = zrow[l / 4][l % 4 + k * plane];
+                    if (z <= depth.cell_min[cell])
+                        dirty |= 1u << ((frag.x - x0) / hiz_cell + (frag.y - y0) / hiz_cell * (tile_size / hiz_cell));
+                    z = static_cast<type>(e);
+                    depth.cell_max[cell] = std::max(depth.cell_max[cell], e);
+                }
+                written = true;
+            }
+        }
+    }
+    profile_count(PIXELS_TESTED, tested);
+    profile_count(PIXELS_DEPTH_REJECTED, rejected);
+    if (!written)
+        return;
+
+    // refresh the cells whose minimum changed, over all the samples of their pixels, then the tile from its cells
+    for (int c = 0; dirty; c++, dirty >>= 1) {
+        if (!(dirty & 1))
+            continue;
+        const int cx = x0 + c % (tile_size / hiz_cell) * hiz_cell, cy = y0 + c / (tile_size / hiz_cell) * hiz_cell;
+        double zmin = std::numeric_limits<double>::max();
+        for (int k = 0; k < samples; k++)
+            for (int y = cy; y < std::min(cy + hiz_cell, y1); y++)
+                for (int x = cx; x < std::min(cx + hiz_cell, x1); x++)
+                    zmin = std::min(zmin, static_cast<double>(depth.z[x + static_cast<std::size_t>(y) * width + k * plane]));
+        depth.cell_min[cx / hiz_cell + cy / hiz_cell * depth.cells_x] = zmin;
+    }
+    double tile_min = std::numeric_limits<double>::max(), tile_max = -std::numeric_limits<double>::max();
+    for (int cy = y0; cy < y1; cy += hiz_cell) {
+        for (int cx = x0; cx < x1; cx += hiz_cell) {
+            tile_min = std::min(tile_min, depth.cell_min[cx / hiz_cell + cy / hiz_cell * depth.cells_x]);
+            tile_max = std::max(tile_max, depth.cell_max[cx / hiz_cell + cy / hiz_cell * depth.cells_x]);
+        }
+    }
+    depth.tile_min[tile] = tile_min;
+    depth.tile_max[tile] = tile_max;
+}
+
+// barycentric coordinates of the lanes in the face the triangle is a piece of
+inline void face_bar(const Triangle &tri, FragmentPacket &frag) {
+    if (!tri.clipped)
+        return;
+    for (int l = 0; l < packet_size; l++) {
+        const vec3 bar = tri.bar_map * vec3{frag.bar[0][l], frag.bar[1][l], frag.bar[2][l]};
+        for (int i = 0; i < 3; i++)
+            frag.bar[i][l] = bar[i];
+    }
+}
+
+// draw triangle, only the pixels inside the tile [x0, x1) x [y0, y1) are touched; into multisampled buffers the color of a pixel
+// goes to the samples of the pixel the triangle covers
+template<bool multisample, class Format, class S> long long triangle_samples(const Triangle &tri, const S &shader, const int x0, const int y0, const int x1, const int y1,
+                                                                                    ColorBuffer &image, DepthBuffer<Format> &depth) {
+    long long fragments = 0;
+    for_each_block<multisample>(tri, x0, y0, x1, y1, depth, [&](FragmentPacket &frag, int mask, const int *cover) {
+        // shade the lanes left in the mask, the shader may discard some of them
+        face_bar(tri, frag);
+        TGAColor color[packet_size];
+        shader.fragment_packet(tri.iface, frag, mask, color);
+        for (int l = 0; l < packet_size; l++) {
+            if (!(mask >> l & 1))
+                continue;
+            if constexpr (multisample) {
+                for (int k = 0; k < image.samples; k++)
+                    if (cover[l] >> k & 1)
+                        image.set(frag.x + l % 4, frag.y + l / 4, k, color[l]);
+            } else
+                image.set(frag.x + l % 4, frag.y + l / 4, color[l]);
+            fragments++;
+        }
+        return mask;
+    });
+    profile_count(PIXELS_SHADED, fragments);
+    return fragments;
+}
+
+template<class Format, FragmentShader S> long long triangle(const Triangle &tri, const S &shader, const int x0, const int y0, const int x1, const int y1, ColorBuffer &image, DepthBuffer<Format> &depth) {
+    if (depth.samples > 1)
+        return triangle_samples<true>(tri, shader, x0, y0, x1, y1, image, depth);
+    return triangle_samples<false>(tri, shader, x0, y0, x1, y1, image, depth);
+}
+
+// depth only triangle, the blocks go straight from the depth test to the depth buffer
+template<class Format> long long triangle(const Triangle &tri, const int x0, const int y0, const int x1, const int y1, DepthBuffer<Format> &depth) {
+    long long fragments = 0;
+    auto visit = [&](const FragmentPacket &, const int mask, const int *) {
+        fragments += std::popcount(static_cast<unsigned>(mask));
+        return mask;
+    };
+    if (depth.samples > 1)
+        for_each_block<true>(tri, x0, y0, x1, y1, depth, visit);
+    else
+        for_each_block<false>(tri, x0, y0, x1, y1, depth, visit);
+    return fragments;
+}
+
+// visibility pass of a triangle: depth test only, the G-buffer records which triangle is on top, returns the number of fragments that passed;
+// the depth buffer is single sampled
+template<class Format> long long triangle(const Triangle &tri, const int id, const int x0, const int y0, const int x1, const int y1, GBuffer &gbuffer, DepthBuffer<Format> &depth) {
+    long long fragments = 0;
+    for_each_block<false>(tri, x0, y0, x1, y1, depth, [&](const FragmentPacket &frag, int mask, const int *) {
+        for (int l = 0; l < packet_size; l++) {
+            if (mask >> l & 1) {
+                gbuffer.id[frag.x + l % 4 + static_cast<std::size_t>(frag.y + l / 4) * gbuffer.width] = id;
+                fragments++;
+            }
+        }
+        return mask;
+    });
+    return fragments;
+}
+
+// vertex stage, primitive assembly and binning shared by all draw calls, bins list the triangles overlapping each tile in submission order;
+// margin widens the triangles as in setup_triangle
+template<class S> DrawStats bin_triangles(const int nverts, std::span<const int> indices, const std::vector<int> *faces, S &shader, const int width, const int height,
+                                                  const double margin, std::vector<Triangle> &tris, std::vector<std::vector<int>> &bins) {
+    // the faces drawn, all of them or a list of face ids; the triangles keep the ids of their faces for the fragment shader
+    const int nfaces = faces ? faces->size() : indices.size() / 3;
+    auto face = [faces](const int i) { return faces ? (*faces)[i] : i; };
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    ClipPlane planes[9];
+    clip_volume(width, height, margin, planes);
+
+    // vertex stage, each vertex is transformed once however many faces share it, the shader keeps its varyings per vertex so the vertices are independent
+    auto start = std::chrono::steady_clock::now();
+    std::vector<vec4> screen(nverts);  // post-transform buffer
+    std::vector<int> code(nverts);     // outcodes of the vertices
+    const mat<4, 4> viewport = Viewport;
+    ProfileScope stage("vertex");
+    // with a list of faces only their vertices are transformed
+    std::vector<char> used;
+    if (faces) {
+        used.resize(nverts);
+        for (const int f : *faces)
+            used[indices[f * 3]] = used[indices[f * 3 + 1]] = used[indices[f * 3 + 2]] = 1;
+    }
+    #pragma omp parallel for
+    for (int i = 0; i < nverts; i++) {
+        if (faces && !used[i])
+            continue;
+        shader.vertex(i, screen[i]);
+        // canonical frustum -> screen space
+        screen[i] = viewport * screen[i];
+        code[i] = outcode(screen[i], planes);
+    }
+    DrawStats stats;
+    stats.vertex_ms = elapsed_ms(start);
+
+    // primitive assembly from the post-transform buffer: frustum culling on the outcodes, then triangle setup with back-face and
+    // degenerate culling; the few faces that cross the near plane or the guard band are left for clipping
+    stage.next("assembly");
+    tris.resize(nfaces);
+    std::vector<signed char> cull(nfaces);  // Cull of each face, -1 if it has to be clipped
+    #pragma omp parallel for
+    for (int i = 0; i < nfaces; i++) {
+        const int *v = &indices[face(i) * 3];
+        if (code[v[0]] & code[v[1]] & code[v[2]] & frustum_planes)
+            cull[i] = OUTSIDE;
+        else if ((code[v[0]] | code[v[1]] | code[v[2]]) & clip_planes)
+            cull[i] = -1;
+        else {
+            const vec4 pts[3] = {screen[v[0]], screen[v[1]], screen[v[2]]};
+            cull[i] = setup_triangle(pts, face(i), width, height, tris[i], margin);
+        }
+    }
+
+    // clipping, in face order, the pieces of the clipped faces follow the faces in tris
+    stage.next("clip");
+    struct Pieces { int first, last; Cull cull; };
+    std::vector<Pieces> pieces;
+    for (int i = 0; i < nfaces; i++) {
+        if (cull[i] >= 0)
+            continue;
+        const int *v = &indices[face(i) * 3];
+        const vec4 pts[3] = {screen[v[0]], screen[v[1]], screen[v[2]]};
+        const int first = tris.size();
+        const Cull c = clip_triangle(pts, code[v[0]] | code[v[1]] | code[v[2]], face(i), planes, width, height, margin, tris);
+        pieces.push_back({first, static_cast<int>(tris.size()), c});
+    }
+
+    // binning, done serially so every tile sees its triangles in submission order and the output is deterministic
+    stage.next("bin");
+    stats.faces = nfaces;
+    stats.clipped = pieces.size();
+    bins.assign(tiles_x * tiles_y, {});
+    auto piece = pieces.begin();
+    for (int i = 0; i < nfaces; i++) {
+        int first = i, last = i + 1;
+        Cull c = static_cast<Cull>(cull[i]);
+        if (cull[i] < 0) {
+            first = piece->first;
+            last = piece->last;
+            c = piece->cull;
+            ++piece;
+        }
+        switch (c) {
+        case OUTSIDE:    stats.outside++;    continue;
+        case BACKFACE:   stats.backface++;   continue;
+        case DEGENERATE: stats.degenerate++; continue;
+        case VISIBLE:    break;
+        }
+        for (int t = first; t < last; t++) {
+            for (int ty = tris[t].bboxmin[1] / tile_size; ty <= tris[t].bboxmax[1] / tile_size; ty++)
+                for (int tx = tris[t].bboxmin[0] / tile_size; tx <= tris[t].bboxmax[0] / tile_size; tx++)
+                    bins[tx + ty * tiles_x].push_back(t);
+            stats.triangles++;
+        }
+    }
+    stats.setup_ms = elapsed_ms(start) - stats.vertex_ms;
+    profile_count(TRIANGLES_SUBMITTED, stats.faces);
+    profile_count(TRIANGLES_CULLED, stats.outside + stats.backface + stats.degenerate);
+    profile_count(TRIANGLES_RASTERIZED, stats.triangles);
+    return stats;
+}
+
+// draw an indexed triangle list: run the vertex shader once per vertex, bin the triangles into screen tiles, then rasterize the tiles in parallel
+template<class Format, FragmentShader S> DrawStats draw(const int nverts, std::span<const int> indices, S &shader, ColorBuffer &image, DepthBuffer<Format> &zbuffer,
+                                                        const std::vector<int> *faces) {
+    std::vector<Triangle> tris;
+    std::vector<std::vector<int>> bins;
+    DrawStats stats = bin_triangles(nverts, indices, faces, shader, image.width, image.height, zbuffer.samples > 1 ? .5 : 0, tris, bins);
+
+    // rasterization, one tile per task: a tile owns its pixels in image and zbuffer (and its part of the depth hierarchy), so the workers share nothing
+    auto start = std::chrono::steady_clock::now();
+    const int tiles_x = (image.width + tile_size - 1) / tile_size;
+    long long fragments = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:fragments)
+    for (int t = 0; t < static_cast<int>(bins.size()); t++) {
+        const int x0 = (t % tiles_x) * tile_size;
+        const int y0 = (t / tiles_x) * tile_size;
+        const int x1 = std::min(x0 + tile_size, image.width);
+        const int y1 = std::min(y0 + tile_size, image.height);
+        ProfileScope scope("tile");
+        for (const int i : bins[t])
+            fragments += triangle(tris[i], shader, x0, y0, x1, y1, image, zbuffer);
+    }
+    stats.fragments = fragments;
+    stats.raster_ms = elapsed_ms(start);
+    return stats;
+}
+
+// depth only pass of an indexed triangle list, the tiles are rasterized in parallel as in the forward draw
+template<class Format, VertexShader S> DrawStats draw(const int nverts, std::span<const int> indices, S &shader, DepthBuffer<Format> &zbuffer, const std::vector<int> *faces) {
+    std::vector<Triangle> tris;
+    std::vector<std::vector<int>> bins;
+    DrawStats stats = bin_triangles(nverts, indices, faces, shader, zbuffer.width, zbuffer.height, zbuffer.samples > 1 ? .5 : 0, tris, bins);
+
+    auto start = std::chrono::steady_clock::now();
+    const int tiles_x = (zbuffer.width + tile_size - 1) / tile_size;
+    long long fragments = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:fragments)
+    for (int t = 0; t < static_cast<int>(bins.size()); t++) {
+        const int x0 = (t % tiles_x) * tile_size;
+        const int y0 = (t / tiles_x) * tile_size;
+        const int x1 = std::min(x0 + tile_size, zbuffer.width);
+        const int y1 = std::min(y0 + tile_size, zbuffer.height);
+        ProfileScope scope("tile");
+        for (const int i : bins[t])
+            fragments += triangle(tris[i], x0, y0, x1, y1, zbuffer);
+    }
+    stats.fragments = fragments;
+    stats.raster_ms = elapsed_ms(start);
+    return stats;
+}
+
+// visibility pass of an indexed triangle list into the G-buffer, the triangles are kept there until the shading pass
+template<class Format, class S> requires std::derived_from<S, IShader> DrawStats draw(const int nverts, std::span<const int> indices, S &shader, GBuffer &gbuffer,
+                                                                                     DepthBuffer<Format> &zbuffer, const std::vector<int> *faces) {
+    std::vector<Triangle> tris;
+    std::vector<std::vector<int>> bins;
+    DrawStats stats = bin_triangles(nverts, indices, faces, shader, gbuffer.width, gbuffer.height, 0, tris, bins);
+    auto start = std::chrono::steady_clock::now();
+    // only the triangles binned are kept, in submission order, their ids follow the ones of the previous calls of the frame
+    const int first = gbuffer.tris.size();
+    std::vector<int> id(tris.size(), -1);
+    for (const std::vector<int> &bin : bins)
+        for (const int i : bin)
+            id[i] = 0;
+    int kept = 0;
+    for (int i = 0; i < static_cast<int>(tris.size()); i++) {
+        if (id[i] < 0)
+            continue;
+        tris[kept] = tris[i];
+        id[i] = first + kept++;
+    }
+    tris.resize(kept);
+    if (gbuffer.tris.empty())
+        gbuffer.tris = std::move(tris);
+    else
+        gbuffer.tris.insert(gbuffer.tris.end(), tris.begin(), tris.end());
+    gbuffer.shaders.resize(gbuffer.tris.size(), static_cast<const IShader *>(&shader));
+
+    const int tiles_x = (gbuffer.width + tile_size - 1) / tile_size;
+    long long fragments = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:fragments)
+    for (int t = 0; t < static_cast<int>(bins.size()); t++) {
+        const int x0 = (t % tiles_x) * tile_size;
+        const int y0 = (t / tiles_x) * tile_size;
+        const int x1 = std::min(x0 + tile_size, gbuffer.width);
+        const int y1 = std::min(y0 + tile_size, gbuffer.height);
+        ProfileScope scope("tile");
+        for (const int i : bins[t])
+            fragments += triangle(gbuffer.tris[id[i]], id[i], x0, y0, x1, y1, gbuffer, zbuffer);
+    }
+    gbuffer.fragments += fragments;
+    stats.fragments = fragments;
+    stats.raster_ms = elapsed_ms(start);
+    return stats;
+}
+
+// built by our_gl.cpp
+extern template long long triangle(const Triangle &, const IShader &, const int, const int, const int, const int, ColorBuffer &, DepthBuffer<DepthF64> &);
+extern template long long triangle(const Triangle &, const IShader &, const int, const int, const int, const int, ColorBuffer &, DepthBuffer<DepthF32> &);
+extern template long long triangle(const Triangle &, const IShader &, const int, const int, const int, const int, ColorBuffer &, DepthBuffer<DepthU24> &);
+extern template long long triangle(const Triangle &, const IShader &, const int, const int, const int, const int, ColorBuffer &, DepthBuffer<DepthU16> &);
+extern template long long triangle(const Triangle &, const int, const int, const int, const int, DepthBuffer<DepthF64> &);
+extern template long long triangle(const Triangle &, const int, const int, const int, const int, DepthBuffer<DepthF32> &);
+extern template long long triangle(const Triangle &, const int, const int, const int, const int, DepthBuffer<DepthU24> &);
+extern template long long triangle(const Triangle &, const int, const int, const int, const int, DepthBuffer<DepthU16> &);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, ColorBuffer &, DepthBuffer<DepthF64> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, ColorBuffer &, DepthBuffer<DepthF32> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, ColorBuffer &, DepthBuffer<DepthU24> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, ColorBuffer &, DepthBuffer<DepthU16> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, DepthBuffer<DepthF64> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, DepthBuffer<DepthF32> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, DepthBuffer<DepthU24> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, DepthBuffer<DepthU16> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, GBuffer &, DepthBuffer<DepthF64> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, GBuffer &, DepthBuffer<DepthF32> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, GBuffer &, DepthBuffer<DepthU24> &, const std::vector<int> *);
+extern template DrawStats draw(const int, std::span<const int>, IShader &, GBuffer &, DepthBuffer<DepthU16> &, const std::vector<int> *);
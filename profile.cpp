@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include "profile.h"
+
+// events kept per thread, about 24 MB each
+constexpr std::size_t profile_max_events = 1 << 20;
+
+static const std::chrono::steady_clock::time_point profile_epoch = std::chrono::steady_clock::now();
+static std::mutex profile_mutex;
+static std::vector<std::unique_ptr<ProfileThread>> profile_threads;
+static std::vector<ProfileThread *> profile_free;                 // blocks of the threads that exited
+static std::uint64_t profile_retired[PROFILE_COUNTERS] = {};      // their counters
+
+ProfileThread *profile_register() {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    if (!profile_free.empty()) {
+        ProfileThread *t = profile_free.back();
+        profile_free.pop_back();
+        return t;
+    }
+    profile_threads.push_back(std::make_unique<ProfileThread>());
+    profile_threads.back()->tid = profile_threads.size();
+    return profile_threads.back().get();
+}
+
+// the events stay in the block, the next thread adds its own after them on the same track of the trace
+void profile_release(ProfileThread *t) {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        profile_retired[c] += t->counters[c].load(std::memory_order_relaxed);
+        t->counters[c].store(0, std::memory_order_relaxed);
+    }
+    profile_free.push_back(t);
+}
+
+std::int64_t profile_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - profile_epoch).count();
+}
+
+void profile_end(const char *name, const std::int64_t start) {
+    ProfileThread &t = profile_thread();
+    if (t.events.size() < profile_max_events)
+        t.events.push_back({name, start, profile_now() - start});
+    else
+        t.dropped++;
+}
+
+void profile_totals(std::uint64_t totals[PROFILE_COUNTERS]) {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        totals[c] = profile_retired[c];
+        for (const auto &t : profile_threads)
+            totals[c] += t->counters[c].load(std::memory_order_relaxed);
+    }
+}
+
+const char *profile_counter_name(const ProfileCounter c) {
+    static const char *names[PROFILE_COUNTERS] = {"triangles_submitted", "triangles_culled", "triangles_rasterized", "pixels_tested",
+                                                  "pixels_depth_rejected", "pixels_shaded", "texture_samples"};
+    return names[c];
+}
+
+bool profile_write_trace(const std::string filename) {
+    std::uint64_t totals[PROFILE_COUNTERS];
+    profile_totals(totals);
+    std::ofstream out(filename);
+    if (!out.is_open())
+        return false;
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    // complete events in us, one per line
+    out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    std::int64_t end = 0;
+    std::uint64_t dropped = 0;
+    for (const auto &t : profile_threads) {
+        out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t->tid << ", \"args\": {\"name\": \"thread " << t->tid << "\"}},\n";
+        for (const ProfileThread::Event &e : t->events) {
+            out << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << t->tid << ", \"ts\": " << e.start / 1e3
+                << ", \"dur\": " << e.duration / 1e3 << "},\n";
+            end = std::max(end, e.start + e.duration);
+        }
+        dropped += t->dropped;
+    }
+    out << "{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << end / 1e3 << ", \"args\": {";
+    for (int c = 0; c < PROFILE_COUNTERS; c++)
+        out << (c ? ", " : "") << "\"" << profile_counter_name(static_cast<ProfileCounter>(c)) << "\": " << totals[c];
+    out << ", \"dropped_events\": " << dropped << "}}\n]}\n";
+    return out.good();
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// instrumentation of the pipeline, compiled in with -DGAKU_PROFILE (cmake -DGAKU_PROFILE=ON); without it the counters and timers below
+// are empty inline functions that the compiler removes
+#ifdef GAKU_PROFILE
+constexpr bool profiling = true;
+#else
+constexpr bool profiling = false;
+#endif
+
+enum ProfileCounter {
+    TRIANGLES_SUBMITTED,               // faces sent to draw calls
+    TRIANGLES_CULLED,                  // outside of the frustum, back-facing or degenerate
+    TRIANGLES_RASTERIZED,              // triangles binned, pieces of clipped faces included
+    PIXELS_TESTED,                     // covered pixels that went to the depth test
+    PIXELS_DEPTH_REJECTED,             // covered pixels that failed it
+    PIXELS_SHADED,                     // pixels written by a fragment shader
+    TEXTURE_SAMPLES,                   // Texture::sample calls
+    PROFILE_COUNTERS
+};
+
+// counters and trace events of one thread, written by that thread only; when the thread exits its counters are added to the retired
+// totals and the block, with its events, goes to the next thread that registers, so that there are never more blocks than threads alive
+// at once however many threads a pool or the async tasks start over time
+struct ProfileThread {
+    struct Event {
+        const char *name;
+        std::int64_t start, duration;  // ns since the first registered thread
+    };
+    int tid;
+    // relaxed load and store by the owner, a plain add, readable from other threads
+    std::atomic<std::uint64_t> counters[PROFILE_COUNTERS] = {};
+    std::vector<Event> events;
+    std::uint64_t dropped = 0;         // events past the cap of a thread
+};
+
+// a free block, or a new one
+ProfileThread *profile_register();
+// gives the block of an exiting thread back
+void profile_release(ProfileThread *t);
+// the block of a thread, from its first counter or event to its exit
+struct ProfileOwner {
+    ProfileThread *thread = profile_register();
+    ~ProfileOwner() { profile_release(thread); }
+};
+
+// block of the calling thread, registered on the first call
+inline ProfileThread &profile_thread() {
+    thread_local ProfileOwner owner;
+    return *owner.thread;
+}
+
+// ns since the profile epoch
+std::int64_t profile_now();
+
+inline void profile_count(const ProfileCounter c, const std::uint64_t n=1) {
+    if constexpr (profiling) {
+        std::atomic<std::uint64_t> &x = profile_thread().counters[c];
+        x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+}
+
+// times its scope as a trace event of the calling thread, name must be a string literal
+struct ProfileScope {
+    const char *name;
+    std::int64_t start;
+    ProfileScope(const char *n) {
+        if constexpr (profiling) {
+            name = n;
+            start = profile_now();
+        }
+    }
+    ~ProfileScope();
+    // end the event and start the next one, for stages that follow each other in a scope
+    void next(const char *n);
+};
+
+void profile_end(const char *name, const std::int64_t start);
+inline ProfileScope::~ProfileScope() {
+    if constexpr (profiling)
+        profile_end(name, start);
+}
+inline void ProfileScope::next(const char *n) {
+    if constexpr (profiling) {
+        profile_end(name, start);
+        name = n;
+        start = profile_now();
+    }
+}
+
+// counters summed over all the threads, the ones that exited included
+void profile_totals(std::uint64_t totals[PROFILE_COUNTERS]);
+const char *profile_counter_name(const ProfileCounter c);
+// all the events as a Chrome trace (chrome://tracing, Perfetto), with the counter totals at the end; no instrumented code may run meanwhile
+bool profile_write_trace(const std::string filename);
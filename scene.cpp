@@ -0,0 +1,366 @@
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include "scene.h"
+#include "task.h"
+
+void BVH::build(const std::vector<Box> &boxes) {
+    nodes.clear();
+    items.resize(boxes.size());
+    for (int i = 0; i < static_cast<int>(boxes.size()); i++)
+        items[i] = i;
+    if (!boxes.empty())
+        build(boxes, 0, boxes.size());
+}
+
+int BVH::build(const std::vector<Box> &boxes, const int first, const int count) {
+    const int n = nodes.size();
+    nodes.push_back({{}, first, count, -1});
+    Box box, centers;
+    for (int i = first; i < first + count; i++) {
+        box.add(boxes[items[i]]);
+        centers.add(boxes[items[i]].center());
+    }
+    nodes[n].box = box;
+    if (count <= bvh_leaf)
+        return n;
+    // median split along the longest axis of the centers, the halves are built depth first
+    const vec3 extent = centers.max - centers.min;
+    const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+    const int half = count / 2;
+    std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+                     [&](const int a, const int b) { return boxes[a].center()[axis] < boxes[b].center()[axis]; });
+    build(boxes, first, half);
+    const int right = build(boxes, first + half, count - half);
+    nodes[n].right = right;
+    return n;
+}
+
+SceneStats &SceneStats::operator+=(const SceneStats &s) {
+    instances += s.instances;
+    instances_outside += s.instances_outside;
+    instances_occluded += s.instances_occluded;
+    meshlets += s.meshlets;
+    meshlets_outside += s.meshlets_outside;
+    meshlets_occluded += s.meshlets_occluded;
+    return *this;
+}
+
+std::ostream &operator<<(std::ostream &out, const SceneStats &s) {
+    return out << s.instances << " instances, culled " << s.instances_outside << " outside, " << s.instances_occluded << " occluded; " << s.meshlets
+               << " meshlets, culled " << s.meshlets_outside << " outside, " << s.meshlets_occluded << " occluded";
+}
+
+std::shared_ptr<const Model> ModelCache::get(const std::string &filename, const Model::Loader loader) {
+    // a file read by another loader is another entry
+    const std::string key = std::to_string(loader) + ":" + filename;
+    std::promise<std::shared_ptr<const Model>> promise;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto it = entries.find(key); it != entries.end(); it = entries.find(key)) {
+            const std::shared_future<std::shared_ptr<const Model>> model = it->second.model;
+            // a model being loaded is waited for
+            if (!it->second.bytes) {
+                uses.splice(uses.begin(), uses, it->second.use);
+                counters.hits++;
+                lock.unlock();
+                return model.get();
+            }
+            // the files of a loaded model are checked without the lock, so that the other lookups do not wait on the file system
+            const std::shared_ptr<const Model> loaded = model.get();
+            lock.unlock();
+            const bool changed = loaded->changed();
+            lock.lock();
+            it = entries.find(key);
+            if (it == entries.end() || !it->second.bytes || it->second.model.get() != loaded)
+                continue;                // evicted or replaced meanwhile, looked up again
+            if (!changed) {
+                uses.splice(uses.begin(), uses, it->second.use);
+                counters.hits++;
+                return loaded;
+            }
+            // its files changed, it is loaded again
+            counters.bytes -= it->second.bytes;
+            counters.models--;
+            uses.erase(it->second.use);
+            entries.erase(it);
+            break;
+        }
+        counters.misses++;
+        uses.push_front(key);
+        entries[key] = {promise.get_future().share(), 0, uses.begin()};
+    }
+
+    // a load that throws is a model that could not be loaded, the jobs waiting for it are not left blocked
+    std::shared_ptr<const Model> loaded;
+    try {
+        loaded = std::make_shared<const Model>(filename, loader);
+        if (!loaded->nfaces())
+            loaded = nullptr;
+    } catch (const std::exception &e) {
+        std::cerr << "cannot load " << filename << ": " << e.what() << std::endl;
+        loaded = nullptr;
+    }
+    promise.set_value(loaded);
+    // the entry is only removed here while it loads, the models that failed are not kept
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (!loaded) {
+        uses.erase(it->second.use);
+        entries.erase(it);
+        return nullptr;
+    }
+    it->second.bytes = loaded->size();
+    counters.bytes += it->second.bytes;
+    counters.models++;
+    evict();
+    return loaded;
+}
+
+ModelCache::Stats ModelCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+// least recently used models first, except the ones being loaded and the most recent one, which stays even if it is larger than the capacity
+void ModelCache::evict() {
+    for (auto use = uses.end(); counters.bytes > capacity && use != uses.begin(); ) {
+        if (--use == uses.begin())
+            break;
+        auto it = entries.find(*use);
+        if (!it->second.bytes)
+            continue;
+        counters.bytes -= it->second.bytes;
+        counters.models--;
+        counters.evictions++;
+        entries.erase(it);
+        use = uses.erase(use);
+    }
+}
+
+int Scene::mesh(const std::string &filename, const Model::Loader loader) {
+    std::vector<int> ids;
+    return load_meshes({filename}, loader, ids) ? ids[0] : -1;
+}
+
+bool Scene::load_meshes(const std::vector<std::string> &filenames, const Model::Loader loader, std::vector<int> &ids) {
+    auto find = [this](const std::string &filename) {
+        for (int i = 0; i < static_cast<int>(meshes.size()); i++)
+            if (meshes[i].filename == filename)
+                return i;
+        return -1;
+    };
+    std::vector<std::string> missing;
+    for (const std::string &f : filenames)
+        if (find(f) < 0 && std::find(missing.begin(), missing.end(), f) == missing.end())
+            missing.push_back(f);
+
+    // the models are loaded side by side by a few tasks taking the next file in turn, so that the slowest model, not the sum of them,
+    // bounds the loading time; a model decodes its textures in tasks of its own too
+    std::vector<std::shared_ptr<const Model>> models(missing.size());
+    std::atomic<int> next = 0;
+    auto load = [&] {
+        for (int i; (i = next++) < static_cast<int>(missing.size()); )
+            models[i] = cache ? cache->get(missing[i], loader) : std::make_shared<const Model>(missing[i], loader);
+    };
+    const int tasks = std::min<int>(missing.size(), std::max(4u, std::thread::hardware_concurrency()));
+    std::vector<std::future<void>> loading;
+    for (int t = 1; t < tasks; t++)
+        loading.push_back(async_task(load));
+    load();
+    for (auto &f : loading)
+        f.get();
+
+    bool ok = true;
+    for (int i = 0; i < static_cast<int>(missing.size()); i++) {
+        if (!models[i] || !models[i]->nfaces()) {
+            std::cerr << "no faces loaded from " << missing[i] << std::endl;
+            ok = false;
+        } else
+            meshes.push_back({missing[i], models[i]});
+    }
+    ids.clear();
+    for (const std::string &f : filenames)
+        ids.push_back(find(f));
+    return ok;
+}
+
+void Scene::add(const int mesh, const mat<4, 4> &transform) {
+    instances.push_back({mesh, transform});
+}
+
+bool Scene::load(const std::string &filename, const Model::Loader loader) {
+    std::ifstream in(filename);
+    if (in.fail()) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return false;
+    }
+    const size_t slash = filename.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? std::string() : filename.substr(0, slash + 1);
+    // the instances are read first, then their models loaded all at once
+    std::vector<std::string> files;
+    std::vector<mat<4, 4>> transforms;
+    std::string line;
+    for (int n = 1; std::getline(in, line); n++) {
+        std::istringstream iss(line.substr(0, line.find('#')));
+        std::string keyword, file;
+        if (!(iss >> keyword))
+            continue;
+        vec3 t;
+        double yaw = 0, scale = 1;
+        if (keyword != "instance" || !(iss >> file >> t.x >> t.y >> t.z)) {
+            std::cerr << filename << ":" << n << ": expected \"instance file.obj tx ty tz [yaw [scale]]\"" << std::endl;
+            return false;
+        }
+        iss >> yaw >> scale;
+        const double a = yaw * M_PI / 180, c = std::cos(a) * scale, s = std::sin(a) * scale;
+        const mat<4, 4> transform = {{{c, 0, s, t.x}, {0, scale, 0, t.y}, {-s, 0, c, t.z}, {0, 0, 0, 1}}};
+        files.push_back(file[0] == '/' ? file : dir + file);
+        transforms.push_back(transform);
+    }
+    std::vector<int> ids;
+    if (!load_meshes(files, loader, ids))
+        return false;
+    for (int i = 0; i < static_cast<int>(ids.size()); i++)
+        add(ids[i], transforms[i]);
+    return true;
+}
+
+void Scene::build() {
+    for (Mesh &m : meshes) {
+        const Model &model = *m.model;
+        const int nmeshlets = (model.nfaces() + meshlet_size - 1) / meshlet_size;
+        m.meshlets.assign(nmeshlets, {});
+        m.box = {};
+        for (int f = 0; f < model.nfaces(); f++)
+            for (int k = 0; k < 3; k++)
+                m.meshlets[f / meshlet_size].add(model.vert(f, k));
+        for (const Box &b : m.meshlets)
+            m.box.add(b);
+        m.bvh.build(m.meshlets);
+    }
+    std::vector<Box> boxes(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) {
+        Instance &inst = instances[i];
+        inst.box = {};
+        const Box &b = meshes[inst.mesh].box;
+        if (b.min.x <= b.max.x)
+            for (int c = 0; c < 8; c++)
+                inst.box.add(proj<3>(inst.transform * embed<4>(b.corner(c))));
+        boxes[i] = inst.box;
+    }
+    bvh.build(boxes);
+}
+
+// outcome of the test of a box against the view
+enum BoxCull { BOX_VISIBLE, BOX_OUTSIDE, BOX_OCCLUDED };
+
+// box against the frustum of the model -> screen transformation M, a pixel of margin around the screen, then if the box is entirely
+// in front of the camera against the hierarchical depth: it is occluded when every cell under its screen rectangle is closer than
+// its closest point
+template<class Format> static BoxCull test_box(const Box &box, const mat<4, 4> &M, const int width, const int height, const DepthBuffer<Format> *zbuffer) {
+    vec4 p[8];
+    int all = 0x1f;
+    bool front = true;
+    for (int c = 0; c < 8; c++) {
+        p[c] = M * embed<4>(box.corner(c));
+        const double x = p[c][0], y = p[c][1], w = p[c][3];
+        const int code = (x < -w) | (x > width * w) << 1 | (y < -w) << 2 | (y > height * w) << 3 | (w < near_w) << 4;
+        all &= code;
+        front = front && w >= near_w;
+    }
+    if (all)
+        return BOX_OUTSIDE;
+    if (!zbuffer || !front)
+        return BOX_VISIBLE;
+
+    double xmin = width, xmax = 0, ymin = height, ymax = 0, zmax = -1e300;
+    for (const vec4 &q : p) {
+        xmin = std::min(xmin, q[0] / q[3]);
+        xmax = std::max(xmax, q[0] / q[3]);
+        ymin = std::min(ymin, q[1] / q[3]);
+        ymax = std::max(ymax, q[1] / q[3]);
+        zmax = std::max(zmax, q[2] / q[3]);
+    }
+    const DepthBuffer<Format> &depth = *zbuffer;
+    const int x0 = std::max(0, static_cast<int>(std::floor(xmin))), x1 = std::min(width - 1, static_cast<int>(std::ceil(xmax)));
+    const int y0 = std::max(0, static_cast<int>(std::floor(ymin))), y1 = std::min(height - 1, static_cast<int>(std::ceil(ymax)));
+    if (x0 > x1 || y0 > y1)
+        return BOX_OUTSIDE;
+    const double z = depth.encoding.encode(zmax);
+    // whole tiles first, their minimum is a lower bound of the minima of their cells
+    for (int ty = y0 / tile_size; ty <= y1 / tile_size; ty++)
+        for (int tx = x0 / tile_size; tx <= x1 / tile_size; tx++) {
+            if (z < depth.tile_min[tx + ty * depth.tiles_x])
+                continue;
+            const int cx0 = std::max(x0, tx * tile_size) / hiz_cell, cx1 = std::min(x1, tx * tile_size + tile_size - 1) / hiz_cell;
+            const int cy0 = std::max(y0, ty * tile_size) / hiz_cell, cy1 = std::min(y1, ty * tile_size + tile_size - 1) / hiz_cell;
+            for (int cy = cy0; cy <= cy1; cy++)
+                for (int cx = cx0; cx <= cx1; cx++)
+                    if (!(z < depth.cell_min[cx + cy * depth.cells_x]))
+                        return BOX_VISIBLE;
+        }
+    return BOX_OCCLUDED;
+}
+
+void Scene::cull(const mat<4, 4> &VP, const int width, const int height, std::vector<int> &visible, SceneStats &stats) const {
+    visible.clear();
+    bvh.traverse([&](const Box &box, const int count) {
+        if (test_box<DepthF64>(box, VP, width, height, nullptr) == BOX_VISIBLE)
+            return true;
+        stats.instances_outside += count;
+        return false;
+    }, [&](const int i) {
+        if (test_box<DepthF64>(instances[i].box, VP, width, height, nullptr) == BOX_VISIBLE)
+            visible.push_back(i);
+        else
+            stats.instances_outside++;
+    });
+    // front to back, so that the nearest instances fill the depth buffer before the ones behind them are tested against it;
+    // w grows with the distance to the camera
+    std::vector<double> w(instances.size());
+    for (const int i : visible)
+        w[i] = (VP * embed<4>(instances[i].box.center()))[3];
+    std::stable_sort(visible.begin(), visible.end(), [&](const int a, const int b) { return w[a] < w[b]; });
+}
+
+template<class Format> void Scene::faces(const int instance, const mat<4, 4> &VP, const DepthBuffer<Format> &zbuffer, std::vector<int> &faces, SceneStats &stats) const {
+    faces.clear();
+    const Instance &inst = instances[instance];
+    const Mesh &mesh = meshes[inst.mesh];
+    stats.meshlets += mesh.meshlets.size();
+    if (test_box(inst.box, VP, zbuffer.width, zbuffer.height, &zbuffer) == BOX_OCCLUDED) {
+        stats.instances_occluded++;
+        stats.meshlets_occluded += mesh.meshlets.size();
+        return;
+    }
+    const mat<4, 4> M = VP * inst.transform;
+    std::vector<int> meshlets;
+    auto test = [&](const Box &box, const int count) {
+        switch (test_box(box, M, zbuffer.width, zbuffer.height, &zbuffer)) {
+        case BOX_OUTSIDE:  stats.meshlets_outside += count;  return false;
+        case BOX_OCCLUDED: stats.meshlets_occluded += count; return false;
+        case BOX_VISIBLE:  break;
+        }
+        return true;
+    };
+    mesh.bvh.traverse(test, [&](const int k) {
+        if (test(mesh.meshlets[k], 1))
+            meshlets.push_back(k);
+    });
+    // meshlets in face order, so that the draw order does not depend on the tree
+    std::sort(meshlets.begin(), meshlets.end());
+    const int nfaces = mesh.model->nfaces();
+    for (const int k : meshlets)
+        for (int f = k * meshlet_size; f < std::min(nfaces, (k + 1) * meshlet_size); f++)
+            faces.push_back(f);
+}
+
+template void Scene::faces(const int, const mat<4, 4> &, const DepthBuffer<DepthF64> &, std::vector<int> &, SceneStats &) const;
+template void Scene::faces(const int, const mat<4, 4> &, const DepthBuffer<DepthF32> &, std::vector<int> &, SceneStats &) const;
+template void Scene::faces(const int, const mat<4, 4> &, const DepthBuffer<DepthU24> &, std::vector<int> &, SceneStats &) const;
+template void Scene::faces(const int, const mat<4, 4> &, const DepthBuffer<DepthU16> &, std::vector<int> &, SceneStats &) const;
@@ -0,0 +1,152 @@
+#pragma once
+#include <algorithm>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "model.h"
+#include "our_gl.h"
+
+// faces per meshlet, meshes are culled by clusters of consecutive faces so that the faces drawn keep their order
+constexpr int meshlet_size = 64;
+// items per leaf of the bounding volume hierarchies
+constexpr int bvh_leaf = 4;
+
+// axis aligned bounding box, empty until a point is added
+struct Box {
+    vec3 min = {1e300, 1e300, 1e300}, max = {-1e300, -1e300, -1e300};
+    void add(const vec3 &p) {
+        for (int i = 0; i < 3; i++) {
+            min[i] = std::min(min[i], p[i]);
+            max[i] = std::max(max[i], p[i]);
+        }
+    }
+    void add(const Box &b) {
+        add(b.min);
+        add(b.max);
+    }
+    vec3 center() const { return (min + max) / 2; }
+    vec3 corner(const int i) const { return {i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z}; }
+};
+
+// binary tree over a set of boxes, split at the median of the longest axis; nodes are in depth-first order, so the items of a subtree
+// are a contiguous range of items and the first child of an inner node follows it
+struct BVH {
+    struct Node {
+        Box box;
+        int first, count;                // items of the subtree
+        int right;                       // second child of an inner node, -1 for a leaf
+    };
+    std::vector<Node> nodes;
+    std::vector<int> items;              // ids of the boxes the tree was built over
+    void build(const std::vector<Box> &boxes);
+    // depth-first walk, test(box, count) returns whether to enter the node and visit(item) gets the items of the leaves entered
+    template<typename Test, typename Visit> void traverse(Test test, Visit visit) const {
+        if (nodes.empty())
+            return;
+        int stack[64], top = 0;
+        stack[top++] = 0;
+        while (top) {
+            const int n = stack[--top];
+            const Node &node = nodes[n];
+            if (!test(node.box, node.count))
+                continue;
+            if (node.right < 0) {
+                for (int i = node.first; i < node.first + node.count; i++)
+                    visit(items[i]);
+                continue;
+            }
+            stack[top++] = node.right;
+            stack[top++] = n + 1;
+        }
+    }
+private:
+    int build(const std::vector<Box> &boxes, const int first, const int count);
+};
+
+// models loaded once for all the scenes of a process, the least recently used ones are dropped when their size goes over the
+// capacity; the scenes keep the models they use alive, so a model can be dropped while it is rendered. Safe to use concurrently,
+// a model is loaded by the first thread that asks for it and the others wait for it
+struct ModelCache {
+    struct Stats {
+        long long hits = 0, misses = 0, evictions = 0;
+        std::size_t bytes = 0;           // of the models held
+        int models = 0;
+    };
+    explicit ModelCache(const std::size_t capacity) : capacity(capacity) {}
+    // the model of an obj file read by a loader, loaded again if its files changed since; null if it could not be loaded. The
+    // same file read by two loaders is held twice
+    std::shared_ptr<const Model> get(const std::string &filename, const Model::Loader loader);
+    Stats stats() const;
+private:
+    struct Entry {
+        std::shared_future<std::shared_ptr<const Model>> model;
+        std::size_t bytes = 0;           // 0 while loading
+        std::list<std::string>::iterator use;
+    };
+    const std::size_t capacity;
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;  // by "loader:filename"
+    std::list<std::string> uses;         // keys, most recently used first
+    Stats counters;
+    void evict();
+};
+
+// mesh data shared by the instances of a model
+struct Mesh {
+    std::string filename;
+    std::shared_ptr<const Model> model;
+    std::vector<Box> meshlets{};         // meshlet k holds faces [k * meshlet_size, (k + 1) * meshlet_size)
+    BVH bvh{};                           // over the meshlets, in model space
+    Box box{};                           // the meshlets and the hierarchy are built by Scene::build, after the mesh is loaded
+};
+
+// placement of a mesh in the world
+struct Instance {
+    int mesh;
+    mat<4, 4> transform;                 // model -> world
+    Box box{};                           // in world space, set by Scene::build
+};
+
+// culling counters of a frame, the tests of the strips of a frame are added up: an instance in the frustum of no strip is culled
+// outside once per strip
+struct SceneStats {
+    long long instances = 0;             // instances in the scene, counted once per frame by the caller
+    long long instances_outside = 0;     // outside of the frustum
+    long long instances_occluded = 0;    // behind the depth already drawn
+    long long meshlets = 0;              // meshlets of the instances tested
+    long long meshlets_outside = 0;
+    long long meshlets_occluded = 0;
+    SceneStats &operator+=(const SceneStats &s);
+};
+std::ostream &operator<<(std::ostream &out, const SceneStats &s);
+
+// instances of shared meshes with a hierarchy over the instances and one over the meshlets of each mesh: the subtrees outside
+// of the view frustum, or behind the hierarchical depth buffer, are skipped whole
+struct Scene {
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+    BVH bvh;                             // over the instances, in world space
+    ModelCache *cache = nullptr;         // where the models come from, if any
+
+    // mesh of a model file, loaded once however many instances use it, or taken from the cache; -1 if it could not be loaded
+    int mesh(const std::string &filename, const Model::Loader loader);
+    // meshes of model files, the ones not loaded yet are loaded concurrently; false if one of them could not be loaded
+    bool load_meshes(const std::vector<std::string> &filenames, const Model::Loader loader, std::vector<int> &ids);
+    void add(const int mesh, const mat<4, 4> &transform);
+    // one instance per line "instance file.obj tx ty tz [yaw [scale]]", yaw in degrees around the vertical axis, files relative
+    // to the scene file, "#" starts a comment
+    bool load(const std::string &filename, const Model::Loader loader);
+    // meshlets and hierarchies, once all the instances are added
+    void build();
+    Box bounds() const { return bvh.nodes.empty() ? Box() : bvh.nodes[0].box; }
+    // instances that intersect the frustum of the world -> screen transformation VP, nearest first; counts the ones culled only
+    void cull(const mat<4, 4> &VP, const int width, const int height, std::vector<int> &visible, SceneStats &stats) const;
+    // faces of an instance in meshlets that intersect the frustum and are not behind the depth already drawn, in face order,
+    // empty if the whole instance is hidden
+    template<class Format> void faces(const int instance, const mat<4, 4> &VP, const DepthBuffer<Format> &zbuffer, std::vector<int> &faces, SceneStats &stats) const;
+};
@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "server.h"
+
+// OpenMP threads of the parallel regions started by the calling thread
+static int max_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static void set_threads(const int n) {
+#ifdef _OPENMP
+    omp_set_num_threads(n);
+#else
+    (void)n;
+#endif
+}
+
+JobPool::JobPool(const int workers) {
+    const int share = std::max(1, max_threads() / std::max(1, workers));
+    for (int i = 0; i < std::max(1, workers); i++) {
+        threads.emplace_back([this, share] {
+            set_threads(share);
+            for (;;) {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this] { return done || !queue.empty(); });
+                    if (queue.empty())
+                        return;
+                    job = std::move(queue.front());
+                    queue.pop_front();
+                }
+                job();
+            }
+        });
+    }
+}
+
+JobPool::~JobPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    ready.notify_all();
+    for (std::thread &t : threads)
+        t.join();
+}
+
+void JobPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(job));
+    }
+    ready.notify_one();
+}
+
+// whether a line is a job, and sets quit for the one that stops the server
+static bool is_job(const std::string &line, bool &quit) {
+    const size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#')
+        return false;
+    if (!line.compare(first, 4, "quit") && line.find_first_not_of(" \t\r", first + 4) == std::string::npos) {
+        quit = true;
+        return false;
+    }
+    return true;
+}
+
+// jobs from stdin, replies to stdout
+static bool serve_stdin(const int workers, const JobHandler &handler) {
+    std::mutex out;
+    JobPool pool(workers);
+    std::string line;
+    bool quit = false;
+    for (int n = 1; !quit && std::getline(std::cin, line); ) {
+        if (!is_job(line, quit))
+            continue;
+        pool.submit([&out, &handler, line, n] {
+            const std::string reply = handler(line);
+            std::lock_guard<std::mutex> lock(out);
+            std::cout << n << " " << reply << std::endl;
+        });
+        n++;
+    }
+    return true;
+}
+
+// connections of a socket server, each one read by its own thread while its jobs run on the pool
+struct SocketServer {
+    int listener = -1;
+    const JobHandler &handler;
+    JobPool pool;
+    std::atomic<bool> stop = false;
+    std::mutex mutex;
+    std::vector<int> clients;            // connections still open, their reading side is shut down on quit
+    std::vector<std::thread::id> ended;  // threads of the connections closed since the accepting loop last joined them
+
+    SocketServer(const JobHandler &handler, const int workers) : handler(handler), pool(workers) {}
+
+    // shut down the listener and the reading side of the connections, the jobs received still run
+    void quit() {
+        stop = true;
+        ::shutdown(listener, SHUT_RDWR);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const int fd : clients)
+            ::shutdown(fd, SHUT_RD);
+    }
+
+    void connection(const int fd) {
+        // the replies of a connection are written one at a time, and it is closed once all its jobs are answered
+        struct Replies {
+            std::mutex mutex;
+            std::condition_variable answered;
+            int pending = 0;
+        };
+        auto replies = std::make_shared<Replies>();
+        std::string buffer;
+        char chunk[4096];
+        bool quit = false;
+        int n = 1;
+        for (bool end = false; !end; ) {
+            const ssize_t got = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (got < 0 && errno == EINTR)
+                continue;
+            end = got <= 0;
+            if (got > 0)
+                buffer.append(chunk, got);
+            // whole lines, and what is left at the end of the connection
+            size_t start = 0;
+            for (size_t eol; (eol = buffer.find('\n', start)) != std::string::npos || (end && start < buffer.size()); ) {
+                if (eol == std::string::npos)
+                    eol = buffer.size();
+                const std::string line = buffer.substr(start, eol - start);
+                start = eol + 1;
+                if (!is_job(line, quit)) {
+                    if (quit)
+                        break;
+                    continue;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(replies->mutex);
+                    replies->pending++;
+                }
+                pool.submit([this, fd, replies, line, n] {
+                    const std::string reply = std::to_string(n) + " " + handler(line) + "\n";
+                    std::lock_guard<std::mutex> lock(replies->mutex);
+                    ::send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+                    replies->pending--;
+                    replies->answered.notify_all();
+                });
+                n++;
+            }
+            buffer.erase(0, std::min(start, buffer.size()));
+            // like on stdin, nothing after quit runs: the rest of the connection is dropped
+            if (quit) {
+                this->quit();
+                break;
+            }
+        }
+        {
+            std::unique_lock<std::mutex> lock(replies->mutex);
+            replies->answered.wait(lock, [&] { return !replies->pending; });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            clients.erase(std::find(clients.begin(), clients.end(), fd));
+            ended.push_back(std::this_thread::get_id());
+        }
+        ::close(fd);
+    }
+
+    // join the threads of the connections that ended, so that a long running server does not keep one per connection it ever had
+    void join_ended(std::vector<std::thread> &connections) {
+        std::vector<std::thread::id> ids;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ids.swap(ended);
+        }
+        for (const std::thread::id id : ids) {
+            const auto t = std::find_if(connections.begin(), connections.end(), [id](const std::thread &t) { return t.get_id() == id; });
+            t->join();
+            connections.erase(t);
+        }
+    }
+};
+
+static bool serve_socket(const std::string &path, const int workers, const JobHandler &handler) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long " << path << std::endl;
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    SocketServer server(handler, workers);
+    server.listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(path.c_str());
+    if (server.listener < 0 || ::bind(server.listener, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) || ::listen(server.listener, 16)) {
+        std::cerr << "can't listen on " << path << ": " << std::strerror(errno) << std::endl;
+        if (server.listener >= 0)
+            ::close(server.listener);
+        return false;
+    }
+    std::cerr << "listening on " << path << std::endl;
+    std::vector<std::thread> connections;
+    while (!server.stop) {
+        const int fd = ::accept(server.listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        server.join_ended(connections);
+        {
+            std::lock_guard<std::mutex> lock(server.mutex);
+            server.clients.push_back(fd);
+            // a connection accepted while quitting gets no more jobs
+            if (server.stop)
+                ::shutdown(fd, SHUT_RD);
+        }
+        connections.emplace_back(&SocketServer::connection, &server, fd);
+    }
+    for (std::thread &t : connections)
+        t.join();
+    ::close(server.listener);
+    ::unlink(path.c_str());
+    return true;
+}
+
+bool serve(const std::string &socket, const int workers, const JobHandler &handler) {
+    return socket.empty() ? serve_stdin(workers, handler) : serve_socket(socket, workers, handler);
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// fixed set of workers running jobs in the order they are submitted; each worker gets an equal share of the OpenMP threads, so that
+// jobs running side by side do not oversubscribe the cores
+struct JobPool {
+    explicit JobPool(const int workers);
+    // runs the jobs still queued, then joins the workers
+    ~JobPool();
+    void submit(std::function<void()> job);
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::function<void()>> queue;
+    bool done = false;
+    std::vector<std::thread> threads;
+};
+
+// runs one job, a line of arguments, and returns its reply line; called concurrently from the workers
+typedef std::function<std::string(const std::string &job)> JobHandler;
+
+// serve jobs, one per line, on a unix socket or, with an empty path, from stdin; jobs are run by a pool of the given number of workers
+// and each one is answered with a line "n reply", n counting the jobs of the connection from 1, in the order they finish. Blank lines
+// and lines starting with "#" are skipped, "quit" stops the server once the jobs already received are done (stdin stops at its end too)
+bool serve(const std::string &socket, const int workers, const JobHandler &handler);
@@ -0,0 +1,295 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "model.h"
+#include "pipeline.h"
+
+// forces the inlining of the shader kernels into the loops of the pipeline, where the compiler supports it
+#if defined(__GNUC__)
+#define GAKU_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define GAKU_ALWAYS_INLINE
+#endif
+
+// light direction
+constexpr vec3 light_dir = {1, 1, 1};
+
+// shadow map of the light: depth from the light along -light_dir, larger is closer to the light
+typedef DepthBuffer<DepthF32> ShadowMap;
+// depth offset of the shadow test against self-shadowing (acne), in texels of the shadow map: the error of the test grows with the
+// area a texel covers, so the offset follows the scale of the light view
+constexpr double shadow_bias = 14;
+
+// vertex shader of depth only passes, positions only; final so that the depth only pipeline inlines it
+struct DepthShader final: IShader {
+    const Model &model;
+    mat<4, 4> uniform_MVP;
+
+    // transform places the model in the world
+    DepthShader(const Model &m, const mat<4, 4> &transform=mat<4, 4>::identity()): model(m), uniform_MVP(Projection * ModelView * transform) {}
+
+    virtual void vertex(const int ivert, vec4 &gl_Position) {
+        gl_Position = uniform_MVP * embed<4>(model.vert(ivert));
+    }
+
+    // not called by depth only draws
+    virtual bool fragment(const int, const vec3, TGAColor &) const {
+        return true;
+    }
+};
+
+// Blinn-Phong shading of a textured model, lit by light_dir; the shadow map and the normal map are options of the uniforms, each combination
+// of them has a kernel of its own that the forward draw is instantiated for (see ShaderKernel), the IShader functions pick the kernel at run time
+struct Shader final: IShader {
+    const Model &model;
+    // transformation of the model to world space, the placement of its instance
+    mat<4, 4> uniform_W;
+    // light direction in camera space
+    vec3 uniform_l;
+    // transformation of the vertices to camera space, of the normal vectors (its inverse transpose), and projection
+    mat<4, 4> uniform_M, uniform_MIT, uniform_P;
+    // texture coordinates, per vertex
+    std::vector<vec2> varying_uv;
+    // normal vector, per vertex
+    std::vector<vec3> varying_nrm;
+    // whether the normals are perturbed by the tangent space normal map of the model
+    bool uniform_normalmap = false;
+    // tangent frame in camera space, per vertex, w is the sign of the bitangent
+    std::vector<vec4> varying_tan;
+    // texture filtering
+    Texture::Filter uniform_filter;
+    // shadow map of the light and the transformation of the vertices into it, none for unshadowed lighting
+    const ShadowMap *uniform_shadow = nullptr;
+    mat<4, 4> uniform_Mshadow;
+    // shadow_bias in the depth units of the shadow map
+    double uniform_bias = 0;
+    // position in the shadow map, per vertex
+    std::vector<vec3> varying_shadow;
+
+    Shader(const Model &m, const Texture::Filter filter, const mat<4, 4> &transform=mat<4, 4>::identity()):
+            model(m), uniform_W(transform), varying_uv(m.nverts()), varying_nrm(m.nverts()), uniform_filter(filter) {
+        uniforms();
+        normal_map(true);
+    }
+
+    // uniforms of the current camera
+    void uniforms() {
+        uniform_M = ModelView * uniform_W;
+        uniform_MIT = uniform_M.invert_transpose();
+        uniform_P = Projection;
+        // transform light direction to camera space
+        uniform_l = proj<3>(ModelView * embed<4>(light_dir, 0.)).normalized();
+    }
+
+    // shadow map rendered with the current matrices, or none
+    void shadow(const ShadowMap *map) {
+        uniform_shadow = map;
+        uniform_Mshadow = Viewport * Projection * ModelView * uniform_W;
+        // a texel is 1 / Viewport[0][0] of the light view across, its depth is scaled by Viewport[2][2]
+        uniform_bias = shadow_bias * Viewport[2][2] / Viewport[0][0];
+        varying_shadow.resize(map ? model.nverts() : 0);
+    }
+
+    // normal mapping on or off, it stays off for a model without a normal map
+    void normal_map(const bool on) {
+        uniform_normalmap = on && model.normal_map().width() > 0;
+        varying_tan.resize(uniform_normalmap ? model.nverts() : 0);
+    }
+
+    // fraction of the light reaching a point of the shadow map, 3x3 percentage closer filtering: the depth test is done on each
+    // texel around the point and the results averaged, the points outside of the map are lit; texel centers are at integer coordinates,
+    // the window is centered on the nearest one
+    double light(const double x, const double y, const double z) const {
+        const ShadowMap &map = *uniform_shadow;
+        const int cx = static_cast<int>(std::lround(x)), cy = static_cast<int>(std::lround(y));
+        int lit = 0;
+        for (int j = cy - 1; j <= cy + 1; j++)
+            for (int i = cx - 1; i <= cx + 1; i++)
+                lit += i < 0 || j < 0 || i >= map.width || j >= map.height || z + uniform_bias >= map.get(i, j);
+        return lit / 9.;
+    }
+
+    // shadowing of a point of face iface, the shadowed side keeps 30% of the light; 1 without a shadow map
+    double shadowing(const int iface, const vec3 bc) const {
+        if (!uniform_shadow)
+            return 1;
+        vec3 p = {0, 0, 0};
+        for (int i = 0; i < 3; i++)
+            p = p + varying_shadow[model.index(iface, i)] * bc[i];
+        return .3 + .7 * light(p.x, p.y, p.z);
+    }
+
+    // calls f.template operator()<shadowed, normalmapped>() for the variant of the current uniforms
+    template<typename F> auto variant(F f) const {
+        if (uniform_shadow)
+            return uniform_normalmap ? f.template operator()<true, true>() : f.template operator()<true, false>();
+        return uniform_normalmap ? f.template operator()<false, true>() : f.template operator()<false, false>();
+    }
+
+    virtual void vertex(const int ivert, vec4 &gl_Position) {
+        variant([&]<bool shadowed, bool normalmapped>() { vertex_kernel<shadowed, normalmapped>(ivert, gl_Position); });
+    }
+
+    // vertex shader of a variant, inlined into the vertex loop of the draw instantiated for it
+    template<bool shadowed, bool normalmapped> GAKU_ALWAYS_INLINE void vertex_kernel(const int ivert, vec4 &gl_Position) {
+        if constexpr (shadowed) {
+            const vec4 p = uniform_Mshadow * embed<4>(model.vert(ivert));
+            varying_shadow[ivert] = proj<3>(p / p[3]);
+        }
+        varying_uv[ivert] = model.uv(ivert);
+        // transform normal vector to camera space, note that the matrix is the inverse transpose of that of the vertex
+        varying_nrm[ivert] = proj<3>(uniform_MIT * embed<4>(model.normal(ivert), 0.f));
+        // the tangent lies in the surface and transforms as the vertices do, its sign is kept
+        if constexpr (normalmapped) {
+            const vec4 t = model.tangent(ivert);
+            varying_tan[ivert] = embed<4>(proj<3>(uniform_M * embed<4>(proj<3>(t), 0.)), t[3]);
+        }
+        gl_Position = uniform_P * (uniform_M * embed<4>(model.vert(ivert)));
+    }
+
+    // gather the varyings of the vertices of face iface, one column per vertex; the tangents only when tan is given
+    void varyings(const int iface, mat<2, 3> &uv, mat<3, 3> &nrm, mat<4, 3> *tan=nullptr) const {
+        for (int i = 0; i < 3; i++) {
+            const int ivert = model.index(iface, i);
+            uv.set_col(i, varying_uv[ivert]);
+            nrm.set_col(i, varying_nrm[ivert]);
+            if (tan)
+                tan->set_col(i, varying_tan[ivert]);
+        }
+    }
+
+    // normal n perturbed by the normal map texel c (BGRA in [0, 255]) in the interpolated tangent frame t: the bitangent is rebuilt from
+    // the tangent and the interpolated normal, neither normalized, as MikkTSpace does
+    vec3 perturb(const vec4 &t, const vec3 &n, const vec4 &c) const {
+        const vec3 tan = proj<3>(t), bitan = cross(n, tan) * (t[3] < 0 ? -1 : 1);
+        return tan * (c[2] * 2 / 255. - 1) + bitan * (c[1] * 2 / 255. - 1) + n * (c[0] * 2 / 255. - 1);
+    }
+
+    // fragment shader, without the derivatives of a quad the textures are filtered on their base level
+    virtual bool fragment(const int iface, const vec3 bc, TGAColor &gl_FragColor) const {
+        mat<2, 3> varying_uv_tri;
+        mat<3, 3> varying_nrm_tri;
+        mat<4, 3> varying_tan_tri;
+        varyings(iface, varying_uv_tri, varying_nrm_tri, uniform_normalmap ? &varying_tan_tri : nullptr);
+        // interpolate normal vector and texture coordinates, perturb the normal by the normal map
+        vec2 uv = varying_uv_tri * bc;
+        vec3 n = varying_nrm_tri * bc;
+        if (uniform_normalmap)
+            n = perturb(varying_tan_tri * bc, n, model.normal_map().sample(uv.x, uv.y, 0, uniform_filter));
+        n = n.normalized();
+
+        // diffuse lighting
+        double diff = std::max(0., n * uniform_l);
+        // reflection light
+        vec3 r = (n * (n * uniform_l) * 2 - uniform_l).normalized();;
+        // specular lighting, because the camera is looking at -z direction, so the intensity is proportional to r.z
+        double spec = std::pow(std::max(r.z, 0.), 5 + model.specular().sample(uv.x, uv.y, 0, uniform_filter)[0]);
+        // color from texture
+        vec4 color = model.diffuse().sample(uv.x, uv.y, 0, uniform_filter);
+        // Blinn-Phong reflection model, in the shadow of the light
+        const double shadow = shadowing(iface, bc);
+        for (int i = 0; i < 3; i++) {
+            gl_FragColor[i] = std::min<int>(10 + color[i] * (diff + spec) * shadow, 255);
+        }
+        return false;
+    }
+
+    virtual void fragment_packet(const int iface, const FragmentPacket &frag, int &mask, TGAColor gl_FragColor[packet_size]) const {
+        variant([&]<bool shadowed, bool normalmapped>() { fragment_kernel<shadowed, normalmapped>(iface, frag, mask, gl_FragColor); });
+    }
+
+    // fragment shader of a variant for a whole block, same shading as fragment() with the lanes in structure-of-arrays form so that the loops vectorize;
+    // inlined into the block loop of the draw instantiated for it, past the size the compiler would inline on its own
+    template<bool shadowed, bool normalmapped> GAKU_ALWAYS_INLINE void fragment_kernel(const int iface, const FragmentPacket &frag, int &mask, TGAColor gl_FragColor[packet_size]) const {
+        mat<2, 3> uv;
+        mat<3, 3> nrm;
+        mat<4, 3> tan;
+        varyings(iface, uv, nrm, normalmapped ? &tan : nullptr);
+        double nx[packet_size], ny[packet_size], nz[packet_size], u[packet_size], v[packet_size];
+        double t[4][packet_size];
+        #pragma omp simd
+        for (int l = 0; l < packet_size; l++) {
+            const double b0 = frag.bar[0][l], b1 = frag.bar[1][l], b2 = frag.bar[2][l];
+            // interpolate normal vector, texture coordinates and tangent frame
+            nx[l] = nrm[0][2] * b2 + nrm[0][1] * b1 + nrm[0][0] * b0;
+            ny[l] = nrm[1][2] * b2 + nrm[1][1] * b1 + nrm[1][0] * b0;
+            nz[l] = nrm[2][2] * b2 + nrm[2][1] * b1 + nrm[2][0] * b0;
+            u[l] = uv[0][2] * b2 + uv[0][1] * b1 + uv[0][0] * b0;
+            v[l] = uv[1][2] * b2 + uv[1][1] * b1 + uv[1][0] * b0;
+            if constexpr (normalmapped)
+                for (int i = 0; i < 4; i++)
+                    t[i][l] = tan[i][2] * b2 + tan[i][1] * b1 + tan[i][0] * b0;
+        }
+        // texture footprint of the pixels from the derivatives of the texture coordinates across the 2x2 quads
+        double dudx[packet_size], dudy[packet_size], dvdx[packet_size], dvdy[packet_size];
+        quad_derivatives(u, dudx, dudy);
+        quad_derivatives(v, dvdx, dvdy);
+        // perturb the normals by the normal map, one fetch per lane
+        if constexpr (normalmapped) {
+            const Texture &nm = model.normal_map();
+            for (int l = 0; l < packet_size; l++) {
+                if (!(mask >> l & 1))
+                    continue;
+                const vec3 n = perturb({t[0][l], t[1][l], t[2][l], t[3][l]}, {nx[l], ny[l], nz[l]},
+                                       nm.sample(u[l], v[l], nm.lod(dudx[l], dvdx[l], dudy[l], dvdy[l]), uniform_filter));
+                nx[l] = n.x;
+                ny[l] = n.y;
+                nz[l] = n.z;
+            }
+        }
+        double diff[packet_size], rz[packet_size];
+        #pragma omp simd
+        for (int l = 0; l < packet_size; l++) {
+            // normalize the normal vector
+            const double len = std::sqrt(nz[l] * nz[l] + ny[l] * ny[l] + nx[l] * nx[l]);
+            const double x = nx[l] / len, y = ny[l] / len, z = nz[l] / len;
+            // diffuse lighting
+            const double nl = z * uniform_l.z + y * uniform_l.y + x * uniform_l.x;
+            diff[l] = std::max(0., nl);
+            // reflection light, only its z component is needed
+            const double rx = x * nl * 2 - uniform_l.x, ry = y * nl * 2 - uniform_l.y, r = z * nl * 2 - uniform_l.z;
+            rz[l] = r / std::sqrt(r * r + ry * ry + rx * rx);
+        }
+        // specular lighting, the texels are fetched per lane and the powers computed over all the lanes
+        const Texture &diffuse = model.diffuse(), &specular = model.specular();
+        double s[packet_size], spec[packet_size];
+        for (int l = 0; l < packet_size; l++)
+            s[l] = mask >> l & 1 ? specular.sample(u[l], v[l], specular.lod(dudx[l], dvdx[l], dudy[l], dvdy[l]), uniform_filter)[0] : 0;
+        #pragma omp simd
+        for (int l = 0; l < packet_size; l++) {
+            spec[l] = std::pow(std::max(rz[l], 0.), 5 + s[l]);
+        }
+        for (int l = 0; l < packet_size; l++) {
+            if (!(mask >> l & 1))
+                continue;
+            // Blinn-Phong reflection model with the color from texture, in the shadow of the light
+            const vec4 color = diffuse.sample(u[l], v[l], diffuse.lod(dudx[l], dvdx[l], dudy[l], dvdy[l]), uniform_filter);
+            double shadow = 1;
+            if constexpr (shadowed)
+                shadow = shadowing(iface, {frag.bar[0][l], frag.bar[1][l], frag.bar[2][l]});
+            for (int i = 0; i < 3; i++)
+                gl_FragColor[l][i] = std::min<int>(10 + color[i] * (diff[l] + spec[l]) * shadow, 255);
+        }
+    }
+};
+
+// one variant of a Shader as a shader type of its own, not polymorphic: the pipeline instantiated for it calls the kernels directly
+template<bool shadowed, bool normalmapped> struct ShaderKernel {
+    Shader &shader;
+    void vertex(const int ivert, vec4 &gl_Position) {
+        shader.vertex_kernel<shadowed, normalmapped>(ivert, gl_Position);
+    }
+    void fragment_packet(const int iface, const FragmentPacket &frag, int &mask, TGAColor gl_FragColor[packet_size]) const {
+        shader.fragment_kernel<shadowed, normalmapped>(iface, frag, mask, gl_FragColor);
+    }
+};
+
+// forward draw of a Shader with the kernel of its current variant, chosen once per draw call
+template<class Format> DrawStats draw(const int nverts, std::span<const int> indices, Shader &shader, ColorBuffer &image, DepthBuffer<Format> &zbuffer,
+                                      const std::vector<int> *faces=nullptr) {
+    return shader.variant([&]<bool shadowed, bool normalmapped>() {
+        ShaderKernel<shadowed, normalmapped> kernel{shader};
+        return draw(nverts, indices, kernel, image, zbuffer, faces);
+    });
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <future>
+#include <utility>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// std::async on a thread of its own that keeps the OpenMP thread count of the calling thread: a new thread starts from the global
+// count, so the parallel loops of the tasks of a job that got a share of the cores (see JobPool) would spread over all of them
+template<typename F, typename... Args> auto async_task(F &&f, Args &&...args) {
+#ifdef _OPENMP
+    const int threads = omp_get_max_threads();
+    return std::async(std::launch::async, [threads, f = std::forward<F>(f)](auto &&...a) mutable {
+        omp_set_num_threads(threads);
+        return f(std::forward<decltype(a)>(a)...);
+    }, std::forward<Args>(args)...);
+#else
+    return std::async(std::launch::async, std::forward<F>(f), std::forward<Args>(args)...);
+#endif
+}
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cstring>
+#include "profile.h"
+#include "texture.h"
+
+Texture::Texture(const int w, const int h, const int bpp) : bytespp(bpp) {
+    if (w<=0 || h<=0) return;
+    std::size_t size = 0;
+    for (int lw=w, lh=h; ; lw=std::max(1, lw/2), lh=std::max(1, lh/2)) {
+        const int tiles_x = (lw + texture_tile - 1) / texture_tile;
+        const int tiles_y = (lh + texture_tile - 1) / texture_tile;
+        levels.push_back({lw, lh, tiles_x, size});
+        size += std::size_t(tiles_x) * tiles_y * texture_tile * texture_tile;
+        if (lw==1 && lh==1) break;
+    }
+    texels.assign(size, 0);
+}
+
+Texture::Texture(const TGAImage &img) : Texture(img.width(), img.height(), img.bytespp()) {
+    if (levels.empty()) return;
+    const std::uint8_t *data = img.buffer();
+    #pragma omp parallel for
+    for (int y=0; y<height(); y++)
+        for (int x=0; x<width(); x++) {
+            std::uint32_t t = 0;
+            std::memcpy(&t, data + (x + std::size_t(y)*width())*bytespp, bytespp);
+            texels[index(0, x, y)] = t;
+        }
+    // box filter of the 2x2 texels under each texel of the next level, the last row or column of an odd sized level is repeated
+    for (int level=1; level<static_cast<int>(levels.size()); level++) {
+        const Level &src = levels[level-1], &dst = levels[level];
+        #pragma omp parallel for
+        for (int y=0; y<dst.height; y++)
+            for (int x=0; x<dst.width; x++) {
+                const int x0 = std::min(2*x, src.width-1), x1 = std::min(2*x+1, src.width-1);
+                const int y0 = std::min(2*y, src.height-1), y1 = std::min(2*y+1, src.height-1);
+                const std::uint32_t quad[4] = {fetch(level-1, x0, y0), fetch(level-1, x1, y0), fetch(level-1, x0, y1), fetch(level-1, x1, y1)};
+                std::uint32_t t = 0;
+                for (int c=0; c<32; c+=8) {
+                    std::uint32_t sum = 2;
+                    for (const std::uint32_t q : quad) sum += q >> c & 0xff;
+                    t |= (sum / 4) << c;
+                }
+                texels[index(level, x, y)] = t;
+            }
+    }
+}
+
+TGAColor Texture::nearest(const double u, const double v) const {
+    const int x = u * width(), y = v * height();
+    if (levels.empty() || x<0 || y<0 || x>=width() || y>=height())
+        return {};
+    TGAColor ret = {0, 0, 0, 0, static_cast<std::uint8_t>(bytespp)};
+    const std::uint32_t t = fetch(0, x, y);
+    std::memcpy(ret.bgra, &t, 4);
+    return ret;
+}
+
+double Texture::lod(const double dudx, const double dvdx, const double dudy, const double dvdy) const {
+    // squared lengths in texels of the steps of one pixel along x and y, the footprint is as long as the longest one
+    const double x = dudx*width()*dudx*width() + dvdx*height()*dvdx*height();
+    const double y = dudy*width()*dudy*width() + dvdy*height()*dvdy*height();
+    return .5 * std::log2(std::max(x, y));
+}
+
+vec4 Texture::bilinear(const int level, const double u, const double v) const {
+    const Level &l = levels[level];
+    const double x = u * l.width - .5, y = v * l.height - .5;
+    const double fx = std::floor(x), fy = std::floor(y);
+    const double tx = x - fx, ty = y - fy;
+    const int x0 = std::clamp<double>(fx,     0, l.width-1),  x1 = std::clamp<double>(fx + 1, 0, l.width-1);
+    const int y0 = std::clamp<double>(fy,     0, l.height-1), y1 = std::clamp<double>(fy + 1, 0, l.height-1);
+    const std::uint32_t t00 = fetch(level, x0, y0), t10 = fetch(level, x1, y0), t01 = fetch(level, x0, y1), t11 = fetch(level, x1, y1);
+    vec4 ret;
+    for (int c=0; c<4; c++) {
+        const double top    = (t00 >> 8*c & 0xff) * (1 - tx) + (t10 >> 8*c & 0xff) * tx;
+        const double bottom = (t01 >> 8*c & 0xff) * (1 - tx) + (t11 >> 8*c & 0xff) * tx;
+        ret[c] = top * (1 - ty) + bottom * ty;
+    }
+    return ret;
+}
+
+vec4 Texture::sample(const double u, const double v, const double lod, const Filter filter) const {
+    profile_count(TEXTURE_SAMPLES);
+    if (levels.empty())
+        return {};
+    if (filter==NEAREST) {
+        const TGAColor c = nearest(u, v);
+        return {double(c.bgra[0]), double(c.bgra[1]), double(c.bgra[2]), double(c.bgra[3])};
+    }
+    const int last = levels.size()-1;
+    // NaN lod (degenerate derivatives) reads the base level
+    const double l = lod>0 ? std::min<double>(lod, last) : 0;
+    if (filter==BILINEAR)
+        return bilinear(std::lround(l), u, v);
+    const int l0 = std::min<int>(l, last);
+    const double t = l - l0;
+    if (t==0 || l0==last)
+        return bilinear(l0, u, v);
+    return bilinear(l0, u, v) * (1 - t) + bilinear(l0+1, u, v) * t;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+// side length in texels of the square tiles of a texture level
+constexpr int texture_tile = 8;
+static_assert(texture_tile == 8, "the Morton order of a tile is tabulated for 3-bit coordinates");
+
+// texture sampled by the shaders, built from an image at load time: a chain of mip levels down to 1x1, each one stored as 8x8 tiles
+// of 32-bit BGRA texels in Morton order, so that the texels around a sample are a few cache lines away whatever the direction of the walk
+struct Texture {
+    enum Filter { NEAREST, BILINEAR, TRILINEAR };
+    struct Level {
+        int width, height;
+        int tiles_x;                       // number of tiles per row
+        std::size_t offset;                // index of the first texel of the level in texels
+    };
+    std::vector<Level> levels;
+    std::vector<std::uint32_t> texels;     // the channels missing from the image are 0, as in TGAImage::get
+    int bytespp = 0;                       // of the image
+
+    Texture() = default;
+    // levels of a w x h texture, texels are 0
+    Texture(const int w, const int h, const int bpp);
+    // base level copied from the image, the others averaged down from it
+    Texture(const TGAImage &img);
+    int width()  const { return levels.empty() ? 0 : levels[0].width;  }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
+
+    // position in texels of texel (x, y) of a level, inside of it
+    std::size_t index(const int level, const int x, const int y) const {
+        // Morton order of 3-bit coordinates, the bits of x on the even positions
+        static constexpr std::uint8_t spread[texture_tile] = {0, 1, 4, 5, 16, 17, 20, 21};
+        const Level &l = levels[level];
+        const std::size_t tile = (x / texture_tile) + (y / texture_tile) * std::size_t(l.tiles_x);
+        return l.offset + tile * texture_tile * texture_tile + (spread[x % texture_tile] | spread[y % texture_tile] << 1);
+    }
+    std::uint32_t fetch(const int level, const int x, const int y) const { return texels[index(level, x, y)]; }
+    // texel at uv on the base level, black outside of the texture: the same lookup as IShader::sample2D on the image
+    TGAColor nearest(const double u, const double v) const;
+    // level of detail from the derivatives of uv along the screen axes, log2 of the size in base level texels of the footprint of a pixel
+    double lod(const double dudx, const double dvdx, const double dudy, const double dvdy) const;
+    // color at uv, channels in BGRA order in [0, 255]: NEAREST is nearest() whatever the lod, BILINEAR filters the level closest to lod,
+    // TRILINEAR blends the two levels around it; the filtered lookups clamp to the edge texels
+    vec4 sample(const double u, const double v, const double lod, const Filter filter) const;
+private:
+    vec4 bilinear(const int level, const double u, const double v) const;
+};
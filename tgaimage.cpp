@@ -1,22 +1,27 @@
 #include <iostream>
+#include <algorithm>
 #include <cstring>
 #include "tgaimage.h"
 
-TGAImage::TGAImage(const int w, const int h, const int bpp) : w(w), h(h), bpp(bpp), data(w*h*bpp, 0) {}
+TGAImage::TGAImage(const int w, const int h, const int bpp) : w(w), h(h), bpp(bpp), data(size_t(w)*h*bpp, 0) {}
 
 bool TGAImage::read_tga_file(const std::string filename) {
+    // the whole file is read at once and decoded from memory
     std::ifstream in;
-    in.open(filename, std::ios::binary);
+    in.open(filename, std::ios::binary | std::ios::ate);
     if (!in.is_open()) {
-        std::cerr << "can't open file " << filename << "\n";
+        std::cerr << "can't open file " + filename + "\n";
         return false;
     }
+    std::vector<std::uint8_t> file(static_cast<size_t>(in.tellg()));
+    in.seekg(0);
+    in.read(reinterpret_cast<char *>(file.data()), file.size());
     TGAHeader header;
-    in.read(reinterpret_cast<char *>(&header), sizeof(header));
-    if (!in.good()) {
+    if (!in.good() || file.size()<sizeof(header)) {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
+    std::memcpy(&header, file.data(), sizeof(header));
     w   = header.width;
     h   = header.height;
     bpp = header.bitsperpixel>>3;
@@ -24,16 +29,22 @@ bool TGAImage::read_tga_file(const std::string filename) {
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
-    size_t nbytes = bpp*w*h;
+    size_t nbytes = size_t(w)*h*bpp;
     data = std::vector<std::uint8_t>(nbytes, 0);
+    const std::uint8_t *p = file.data() + sizeof(header) + header.idlength;
+    const std::uint8_t *end = file.data() + file.size();
+    // rows are stored top to bottom in memory, the decoder flips them as it writes them
+    const bool vflip = !(header.imagedescriptor & 0x20);
+    const bool hflip = header.imagedescriptor & 0x10;
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read(reinterpret_cast<char *>(data.data()), nbytes);
-        if (!in.good()) {
+        if (p>end || static_cast<size_t>(end-p)<nbytes) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        for (int y=0; y<h; y++)
+            put_pixels(size_t(y)*w, w, p + size_t(y)*w*bpp, true, vflip, hflip);
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
+        if (!load_rle_data(p, end, vflip, hflip)) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
@@ -41,116 +52,105 @@ bool TGAImage::read_tga_file(const std::string filename) {
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20))
-        flip_vertically();
-    if (header.imagedescriptor & 0x10)
-        flip_horizontally();
-    std::cerr << w << "x" << h << "/" << bpp*8 << "\n";
+    // one write, textures are read concurrently
+    std::cerr << std::to_string(w) + "x" + std::to_string(h) + "/" + std::to_string(bpp*8) + "\n";
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
-    size_t pixelcount = w*h;
+// n pixels from position first of the file order (rows of the file, left to right): the n pixels of src, or n times the pixel src if not raw
+void TGAImage::put_pixels(size_t first, size_t n, const std::uint8_t *src, const bool raw, const bool vflip, const bool hflip) {
+    while (n) {
+        const int y = first / w, x = first % w;
+        const int count = std::min<size_t>(n, w - x);
+        std::uint8_t *row = data.data() + size_t(vflip ? h-1-y : y)*w*bpp;
+        if (!hflip && raw)
+            std::memcpy(row + x*bpp, src, count*bpp);
+        else
+            for (int i=0; i<count; i++)
+                std::memcpy(row + (hflip ? w-1-x-i : x+i)*bpp, raw ? src + i*bpp : src, bpp);
+        if (raw) src += count*bpp;
+        first += count;
+        n -= count;
+    }
+}
+
+bool TGAImage::load_rle_data(const std::uint8_t *in, const std::uint8_t *end, const bool vflip, const bool hflip) {
+    size_t pixelcount = size_t(w)*h;
     size_t currentpixel = 0;
-    size_t currentbyte  = 0;
-    TGAColor colorbuffer;
     do {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+        if (in>=end) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
-            }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
+        std::uint8_t chunkheader = *in++;
+        // raw packets hold chunkheader+1 pixels, run packets one pixel repeated chunkheader-127 times
+        const bool raw = chunkheader<128;
+        const size_t count = raw ? chunkheader+1 : chunkheader-127;
+        const size_t bytes = raw ? count*bpp : bpp;
+        if (static_cast<size_t>(end-in)<bytes) {
+            std::cerr << "an error occured while reading the header\n";
+            return false;
+        }
+        if (currentpixel+count>pixelcount) {
+            std::cerr << "Too many pixels read\n";
+            return false;
         }
+        put_pixels(currentpixel, count, in, raw, vflip, hflip);
+        in += bytes;
+        currentpixel += count;
     } while (currentpixel < pixelcount);
     return true;
 }
 
 bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
-    constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
-    constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
-    constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
-    std::ofstream out;
+    TGAWriter out(filename, w, h, bpp, vflip, rle);
+    // bands of scanlines are encoded in parallel and written in order as soon as the previous ones are out
+    bool ok = out.good();
+    #pragma omp parallel for ordered schedule(dynamic, 1)
+    for (int y=0; y<h; y+=tga_band) {
+        const int nrows = std::min(tga_band, h-y);
+        std::vector<std::uint8_t> band = out.encode(data.data() + size_t(y)*w*bpp, nrows);
+        #pragma omp ordered
+        ok = ok && out.write(band, nrows);
+    }
+    return out.close() && ok;
+}
+
+TGAWriter::TGAWriter(const std::string filename, const int w, const int h, const int bpp, const bool vflip, const bool rle) : w(w), h(h), bpp(bpp), rle(rle) {
     out.open(filename, std::ios::binary);
     if (!out.is_open()) {
         std::cerr << "can't open file " << filename << "\n";
-        return false;
+        return;
     }
     TGAHeader header = {};
     header.bitsperpixel = bpp<<3;
     header.width  = w;
     header.height = h;
-    header.datatypecode = (bpp==GRAYSCALE?(rle?11:3):(rle?10:2));
+    header.datatypecode = (bpp==TGAImage::GRAYSCALE?(rle?11:3):(rle?10:2));
     header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin
     out.write(reinterpret_cast<const char *>(&header), sizeof(header));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    if (!rle) {
-        out.write(reinterpret_cast<const char *>(data.data()), w*h*bpp);
-        if (!out.good()) {
-            std::cerr << "can't unload raw data\n";
-            return false;
-        }
-    } else if (!unload_rle_data(out)) {
-            std::cerr << "can't unload rle data\n";
-            return false;
-        }
-    out.write(reinterpret_cast<const char *>(developer_area_ref), sizeof(developer_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    out.write(reinterpret_cast<const char *>(extension_area_ref), sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    out.write(reinterpret_cast<const char *>(footer), sizeof(footer));
-    if (!out.good()) {
+    if (!out.good())
         std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    return true;
 }
 
+TGAWriter::~TGAWriter() {
+    if (out.is_open())
+        close();
+}
+
+bool TGAWriter::good() const {
+    return out.is_open() && out.good();
+}
+
+// packets do not cross the band, so the bands are encoded independently
 // TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) const {
+std::vector<std::uint8_t> TGAWriter::encode(const std::uint8_t *rows, const int nrows) const {
+    const size_t npixels = size_t(w)*nrows;
+    if (!rle)
+        return std::vector<std::uint8_t>(rows, rows + npixels*bpp);
     const std::uint8_t max_chunk_length = 128;
-    size_t npixels = w*h;
+    std::vector<std::uint8_t> ret;
+    ret.reserve(npixels*bpp + npixels/max_chunk_length + 1);
     size_t curpix = 0;
     while (curpix<npixels) {
         size_t chunkstart = curpix*bpp;
@@ -158,9 +158,7 @@ bool TGAImage::unload_rle_data(std::ofstream &out) const {
         std::uint8_t run_length = 1;
         bool raw = true;
         while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bpp; t++)
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bpp]);
+            bool succ_eq = !std::memcmp(rows+curbyte, rows+curbyte+bpp, bpp);
             curbyte += bpp;
             if (1==run_length)
                 raw = !succ_eq;
@@ -173,32 +171,56 @@ bool TGAImage::unload_rle_data(std::ofstream &out) const {
             run_length++;
         }
         curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write(reinterpret_cast<const char *>(data.data()+chunkstart), (raw?run_length*bpp:bpp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
+        ret.push_back(raw?run_length-1:run_length+127);
+        ret.insert(ret.end(), rows+chunkstart, rows+chunkstart+(raw?run_length*bpp:bpp));
+    }
+    return ret;
+}
+
+bool TGAWriter::write(const std::vector<std::uint8_t> &band, const int nrows) {
+    if (!good() || rows+nrows>h)
+        return false;
+    out.write(reinterpret_cast<const char *>(band.data()), band.size());
+    rows += nrows;
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
     }
     return true;
 }
 
+bool TGAWriter::close() {
+    constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
+    constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
+    constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
+    if (!out.is_open())
+        return false;
+    bool ok = out.good() && rows==h;
+    if (rows!=h)
+        std::cerr << "tga file closed after " << rows << " of " << h << " scanlines\n";
+    out.write(reinterpret_cast<const char *>(developer_area_ref), sizeof(developer_area_ref));
+    out.write(reinterpret_cast<const char *>(extension_area_ref), sizeof(extension_area_ref));
+    out.write(reinterpret_cast<const char *>(footer), sizeof(footer));
+    out.close();
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
+    }
+    return ok;
+}
+
 TGAColor TGAImage::get(const int x, const int y) const {
     if (!data.size() || x<0 || y<0 || x>=w || y>=h)
         return {};
     TGAColor ret = {0, 0, 0, 0, bpp};
-    const std::uint8_t *p = data.data()+(x+y*w)*bpp;
+    const std::uint8_t *p = data.data()+(x+size_t(y)*w)*bpp;
     for (int i=bpp; i--; ret.bgra[i] = p[i]);
     return ret;
 }
 
 void TGAImage::set(int x, int y, const TGAColor &c) {
     if (!data.size() || x<0 || y<0 || x>=w || y>=h) return;
-    memcpy(data.data()+(x+y*w)*bpp, c.bgra, bpp);
+    memcpy(data.data()+(x+size_t(y)*w)*bpp, c.bgra, bpp);
 }
 
 void TGAImage::flip_horizontally() {
@@ -206,7 +228,7 @@ void TGAImage::flip_horizontally() {
     for (int i=0; i<half; i++)
         for (int j=0; j<h; j++)
             for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(w-1-i+j*w)*bpp+b]);
+                std::swap(data[(i+size_t(j)*w)*bpp+b], data[(w-1-i+size_t(j)*w)*bpp+b]);
 }
 
 void TGAImage::flip_vertically() {
@@ -214,7 +236,7 @@ void TGAImage::flip_vertically() {
     for (int i=0; i<w; i++)
         for (int j=0; j<half; j++)
             for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(i+(h-1-j)*w)*bpp+b]);
+                std::swap(data[(i+size_t(j)*w)*bpp+b], data[(i+size_t(h-1-j)*w)*bpp+b]);
 }
 
 int TGAImage::width() const {
@@ -225,4 +247,14 @@ int TGAImage::height() const {
     return h;
 }
 
+int TGAImage::bytespp() const {
+    return bpp;
+}
+
+const std::uint8_t *TGAImage::buffer() const {
+    return data.data();
+}
 
+std::uint8_t *TGAImage::buffer() {
+    return data.data();
+}
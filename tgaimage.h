@@ -39,9 +39,12 @@ struct TGAImage {
     void set(const int x, const int y, const TGAColor &c);
     int width()  const;
     int height() const;
+    int bytespp() const;
+    const std::uint8_t *buffer() const;
+    std::uint8_t *buffer();
 private:
-    bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out) const;
+    void put_pixels(size_t first, size_t n, const std::uint8_t *src, const bool raw, const bool vflip, const bool hflip);
+    bool load_rle_data(const std::uint8_t *in, const std::uint8_t *end, const bool vflip, const bool hflip);
 
     int w = 0;
     int h = 0;
@@ -49,3 +52,24 @@ private:
     std::vector<std::uint8_t> data = {};
 };
 
+// scanlines per band of the encoder, bands are encoded in parallel
+constexpr int tga_band = 64;
+
+// tga file written band by band of scanlines in the order of the file, so that the image never has to be complete in memory
+struct TGAWriter {
+    TGAWriter(const std::string filename, const int w, const int h, const int bpp, const bool vflip=true, const bool rle=true);
+    ~TGAWriter();
+    bool good() const;
+    // encoded nrows scanlines of w*bpp bytes each, may be called concurrently for different bands
+    std::vector<std::uint8_t> encode(const std::uint8_t *rows, const int nrows) const;
+    // append the next band of the file
+    bool write(const std::vector<std::uint8_t> &band, const int nrows);
+    bool write_rows(const std::uint8_t *rows, const int nrows) { return write(encode(rows, nrows), nrows); }
+    // write the footer, false if not all the scanlines were written
+    bool close();
+private:
+    std::ofstream out;
+    int w, h, bpp;
+    bool rle;
+    int rows = 0;
+};